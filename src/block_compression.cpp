@@ -0,0 +1,175 @@
+#include "block_compression.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+uint16_t To565(const float c[3])
+{
+    auto quantize = [](float v, int max) {
+        return std::clamp(static_cast<int>(v * max / 255.0f + 0.5f), 0, max);
+    };
+    return static_cast<uint16_t>((quantize(c[0], 31) << 11) | (quantize(c[1], 63) << 5) | quantize(c[2], 31));
+}
+
+void From565(uint16_t c, float out[3])
+{
+    const int r = (c >> 11) & 31;
+    const int g = (c >> 5) & 63;
+    const int b = c & 31;
+    out[0] = static_cast<float>((r << 3) | (r >> 2));
+    out[1] = static_cast<float>((g << 2) | (g >> 4));
+    out[2] = static_cast<float>((b << 3) | (b >> 2));
+}
+
+// Picks endpoints along the principal axis of the block's colours and
+// always encodes in four colour mode.
+void CompressColorBlock(const uint8_t rgba[64], uint8_t out[8])
+{
+    float mean[3] = {};
+    for (int i = 0; i < 16; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            mean[c] += rgba[i * 4 + c];
+        }
+    }
+    for (float& m : mean) {
+        m /= 16.0f;
+    }
+
+    // Covariance: xx, xy, xz, yy, yz, zz
+    float cov[6] = {};
+    for (int i = 0; i < 16; ++i) {
+        const float r = rgba[i * 4] - mean[0];
+        const float g = rgba[i * 4 + 1] - mean[1];
+        const float b = rgba[i * 4 + 2] - mean[2];
+        cov[0] += r * r;
+        cov[1] += r * g;
+        cov[2] += r * b;
+        cov[3] += g * g;
+        cov[4] += g * b;
+        cov[5] += b * b;
+    }
+
+    float axis[3] = { 1.0f, 1.0f, 1.0f };
+    for (int iter = 0; iter < 4; ++iter) {
+        const float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+        const float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+        const float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+        const float len = std::sqrt(x * x + y * y + z * z);
+        if (len < 1e-6f) {
+            break;
+        }
+        axis[0] = x / len;
+        axis[1] = y / len;
+        axis[2] = z / len;
+    }
+
+    int lo = 0;
+    int hi = 0;
+    float lo_proj = INFINITY;
+    float hi_proj = -INFINITY;
+    for (int i = 0; i < 16; ++i) {
+        const float proj = rgba[i * 4] * axis[0] + rgba[i * 4 + 1] * axis[1] + rgba[i * 4 + 2] * axis[2];
+        if (proj < lo_proj) {
+            lo_proj = proj;
+            lo = i;
+        }
+        if (proj > hi_proj) {
+            hi_proj = proj;
+            hi = i;
+        }
+    }
+
+    const float hi_col[3] = { float(rgba[hi * 4]), float(rgba[hi * 4 + 1]), float(rgba[hi * 4 + 2]) };
+    const float lo_col[3] = { float(rgba[lo * 4]), float(rgba[lo * 4 + 1]), float(rgba[lo * 4 + 2]) };
+    uint16_t c0 = To565(hi_col);
+    uint16_t c1 = To565(lo_col);
+    if (c0 < c1) {
+        std::swap(c0, c1);
+    }
+
+    uint32_t indices = 0;
+    if (c0 != c1) {
+        float palette[4][3];
+        From565(c0, palette[0]);
+        From565(c1, palette[1]);
+        for (int c = 0; c < 3; ++c) {
+            palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+            palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+        }
+        for (int i = 0; i < 16; ++i) {
+            int best = 0;
+            float best_dist = INFINITY;
+            for (int p = 0; p < 4; ++p) {
+                float dist = 0.0f;
+                for (int c = 0; c < 3; ++c) {
+                    const float d = rgba[i * 4 + c] - palette[p][c];
+                    dist += d * d;
+                }
+                if (dist < best_dist) {
+                    best_dist = dist;
+                    best = p;
+                }
+            }
+            indices |= static_cast<uint32_t>(best) << (2 * i);
+        }
+    }
+
+    out[0] = c0 & 0xFF;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xFF;
+    out[3] = c1 >> 8;
+    for (int i = 0; i < 4; ++i) {
+        out[4 + i] = (indices >> (8 * i)) & 0xFF;
+    }
+}
+
+void CompressAlphaBlock(const uint8_t rgba[64], uint8_t out[8])
+{
+    int a0 = 0;
+    int a1 = 255;
+    for (int i = 0; i < 16; ++i) {
+        a0 = std::max<int>(a0, rgba[i * 4 + 3]);
+        a1 = std::min<int>(a1, rgba[i * 4 + 3]);
+    }
+    out[0] = static_cast<uint8_t>(a0);
+    out[1] = static_cast<uint8_t>(a1);
+
+    uint64_t indices = 0;
+    if (a0 != a1) {
+        // a0 > a1 selects the eight value interpolation mode.
+        int palette[8];
+        palette[0] = a0;
+        palette[1] = a1;
+        for (int i = 2; i < 8; ++i) {
+            palette[i] = ((8 - i) * a0 + (i - 1) * a1) / 7;
+        }
+        for (int i = 0; i < 16; ++i) {
+            const int a = rgba[i * 4 + 3];
+            int best = 0;
+            for (int p = 1; p < 8; ++p) {
+                if (std::abs(palette[p] - a) < std::abs(palette[best] - a)) {
+                    best = p;
+                }
+            }
+            indices |= static_cast<uint64_t>(best) << (3 * i);
+        }
+    }
+    for (int i = 0; i < 6; ++i) {
+        out[2 + i] = (indices >> (8 * i)) & 0xFF;
+    }
+}
+
+}
+
+void CompressBlockBC1(const uint8_t rgba[64], uint8_t out[8])
+{
+    CompressColorBlock(rgba, out);
+}
+
+void CompressBlockBC3(const uint8_t rgba[64], uint8_t out[16])
+{
+    CompressAlphaBlock(rgba, out);
+    CompressColorBlock(rgba, out + 8);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstdint>
+
+// Software S3TC encoders. Both take a 4x4 block of RGBA8888 pixels, row by
+// row, and write one compressed block.
+
+// 8 bytes out, colour only. Only suitable for opaque blocks.
+void CompressBlockBC1(const uint8_t rgba[64], uint8_t out[8]);
+
+// 16 bytes out, BC1 style colour plus an interpolated alpha block.
+void CompressBlockBC3(const uint8_t rgba[64], uint8_t out[16]);
@@ -0,0 +1,306 @@
+#include "data_snapshot.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+    struct TableHeader
+    {
+        uint32_t narr;
+        uint32_t nhash;
+    };
+
+    constexpr uint64_t HeaderSize = sizeof(TableHeader);
+    constexpr uint64_t SlotSize = sizeof(DataSnapshot::Slot);
+    // Well past any real data, low enough to stay clear of the C stack limit.
+    constexpr int MaxDepth = 100;
+
+    // Orders by type first, matching how the hash parts are sorted.
+    int compare(const DataSnapshot::Key& a, const DataSnapshot::Key& b)
+    {
+        if (a.type != b.type) {
+            return a.type < b.type ? -1 : 1;
+        }
+        if (a.type == LUA_TSTRING) {
+            return a.str.compare(b.str);
+        }
+        return a.number < b.number ? -1 : (a.number > b.number ? 1 : 0);
+    }
+
+    std::mutex published_mtx;
+    std::unordered_map<std::string, std::shared_ptr<const DataSnapshot>> published;
+}
+
+struct SnapshotFreezer
+{
+    lua_State* L;
+    std::string& data;
+    std::string& error;
+    std::unordered_map<const void*, uint64_t> tables;
+    std::unordered_map<std::string_view, uint64_t> strings;
+
+    void write(uint64_t offset, const DataSnapshot::Slot& slot) {
+        std::memcpy(data.data() + offset, &slot, sizeof(slot));
+    }
+
+    uint64_t intern(std::string_view str) {
+        auto [iter, inserted] = strings.try_emplace(str, data.size());
+        if (inserted) {
+            data.append(str);
+        }
+        return iter->second;
+    }
+
+    bool key(int idx, DataSnapshot::Key& key) {
+        key.type = lua_type(L, idx);
+        switch (key.type) {
+        case LUA_TBOOLEAN:
+            key.number = lua_toboolean(L, idx);
+            return true;
+        case LUA_TNUMBER:
+            key.number = lua_tonumber(L, idx);
+            return true;
+        case LUA_TSTRING: {
+            // Points into the Lua string, which the table keeps alive.
+            size_t len = 0;
+            const char* str = lua_tolstring(L, idx, &len);
+            key.str = std::string_view(str, len);
+            return true;
+        }
+        }
+        error = std::string("can't freeze a table with ") + lua_typename(L, key.type) + " keys";
+        return false;
+    }
+
+    void pushKey(const DataSnapshot::Key& key) {
+        switch (key.type) {
+        case LUA_TBOOLEAN:
+            lua_pushboolean(L, key.number != 0.0);
+            break;
+        case LUA_TNUMBER:
+            lua_pushnumber(L, key.number);
+            break;
+        default:
+            lua_pushlstring(L, key.str.data(), key.str.size());
+            break;
+        }
+    }
+
+    bool value(int idx, int depth, DataSnapshot::Slot& slot) {
+        slot.type = lua_type(L, idx);
+        switch (slot.type) {
+        case LUA_TNIL:
+            return true;
+        case LUA_TBOOLEAN:
+            slot.number = lua_toboolean(L, idx);
+            return true;
+        case LUA_TNUMBER:
+            slot.number = lua_tonumber(L, idx);
+            return true;
+        case LUA_TSTRING: {
+            size_t len = 0;
+            const char* str = lua_tolstring(L, idx, &len);
+            if (len > UINT32_MAX) {
+                error = "string too long to freeze";
+                return false;
+            }
+            slot.size = static_cast<uint32_t>(len);
+            slot.offset = intern(std::string_view(str, len));
+            return true;
+        }
+        case LUA_TTABLE:
+            return table(idx, depth, slot.offset);
+        }
+        error = std::string("can't freeze ") + lua_typename(L, slot.type) + " values";
+        return false;
+    }
+
+    bool table(int idx, int depth, uint64_t& offset) {
+        if (idx < 0) {
+            idx = lua_gettop(L) + idx + 1;
+        }
+        auto [iter, inserted] = tables.try_emplace(lua_topointer(L, idx), data.size());
+        offset = iter->second;
+        if (!inserted) {
+            return true;
+        }
+        if (depth >= MaxDepth) {
+            error = "tables are nested too deeply to freeze";
+            return false;
+        }
+        if (!lua_checkstack(L, 3)) {
+            error = "out of stack space";
+            return false;
+        }
+
+        auto narr = static_cast<uint32_t>(lua_objlen(L, idx));
+        std::vector<DataSnapshot::Key> keys;
+        lua_pushnil(L);
+        while (lua_next(L, idx)) {
+            lua_pop(L, 1);
+            if (lua_type(L, -1) == LUA_TNUMBER) {
+                double n = lua_tonumber(L, -1);
+                if (n >= 1 && n <= narr && n == std::floor(n)) {
+                    continue;
+                }
+            }
+            if (!key(-1, keys.emplace_back())) {
+                lua_pop(L, 1);
+                return false;
+            }
+        }
+        std::sort(keys.begin(), keys.end(), [](const auto& a, const auto& b) { return compare(a, b) < 0; });
+
+        // Reserve the whole table up front, the children go after it.
+        TableHeader header{ narr, static_cast<uint32_t>(keys.size()) };
+        data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        data.append((narr + 2 * keys.size()) * SlotSize, '\0');
+
+        uint64_t pos = offset + HeaderSize;
+        for (uint32_t i = 1; i <= narr; i++, pos += SlotSize) {
+            lua_rawgeti(L, idx, static_cast<int>(i));
+            DataSnapshot::Slot slot;
+            bool ok = value(-1, depth + 1, slot);
+            lua_pop(L, 1);
+            if (!ok) {
+                return false;
+            }
+            write(pos, slot);
+        }
+        for (const auto& k : keys) {
+            DataSnapshot::Slot keySlot;
+            keySlot.type = k.type;
+            if (k.type == LUA_TSTRING) {
+                keySlot.size = static_cast<uint32_t>(k.str.size());
+                keySlot.offset = intern(k.str);
+            } else {
+                keySlot.number = k.number;
+            }
+            write(pos, keySlot);
+            pos += SlotSize;
+
+            pushKey(k);
+            lua_rawget(L, idx);
+            DataSnapshot::Slot slot;
+            bool ok = value(-1, depth + 1, slot);
+            lua_pop(L, 1);
+            if (!ok) {
+                return false;
+            }
+            write(pos, slot);
+            pos += SlotSize;
+        }
+        return true;
+    }
+};
+
+std::shared_ptr<const DataSnapshot> DataSnapshot::freeze(lua_State* L, int idx, std::string& error)
+{
+    auto snapshot = std::make_shared<DataSnapshot>();
+    SnapshotFreezer freezer{ L, snapshot->_data, error };
+    uint64_t root;
+    if (!freezer.table(idx, 0, root)) {
+        return nullptr;
+    }
+    snapshot->_data.shrink_to_fit();
+    return snapshot;
+}
+
+DataSnapshot::Slot DataSnapshot::slot(uint64_t offset) const
+{
+    Slot slot;
+    std::memcpy(&slot, _data.data() + offset, sizeof(slot));
+    return slot;
+}
+
+uint32_t DataSnapshot::length(uint64_t table) const
+{
+    TableHeader header;
+    std::memcpy(&header, _data.data() + table, sizeof(header));
+    return header.narr;
+}
+
+uint32_t DataSnapshot::entryCount(uint64_t table) const
+{
+    TableHeader header;
+    std::memcpy(&header, _data.data() + table, sizeof(header));
+    return header.narr + header.nhash;
+}
+
+void DataSnapshot::entry(uint64_t table, uint32_t i, Slot& key, Slot& value) const
+{
+    uint32_t narr = length(table);
+    if (i < narr) {
+        key = Slot();
+        key.type = LUA_TNUMBER;
+        key.number = i + 1;
+        value = slot(table + HeaderSize + i * SlotSize);
+        return;
+    }
+    uint64_t pos = table + HeaderSize + narr * SlotSize + (i - narr) * 2 * SlotSize;
+    key = slot(pos);
+    value = slot(pos + SlotSize);
+}
+
+void DataSnapshot::lookup(uint64_t table, const Key& key, Slot& value) const
+{
+    TableHeader header;
+    std::memcpy(&header, _data.data() + table, sizeof(header));
+    value = Slot();
+    if (key.type == LUA_TNUMBER && key.number >= 1 && key.number <= header.narr && key.number == std::floor(key.number)) {
+        value = slot(table + HeaderSize + (static_cast<uint64_t>(key.number) - 1) * SlotSize);
+        return;
+    }
+    uint64_t hash = table + HeaderSize + header.narr * SlotSize;
+    uint32_t lo = 0;
+    uint32_t hi = header.nhash;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        Slot midSlot = slot(hash + mid * 2 * SlotSize);
+        Key midKey{ static_cast<int>(midSlot.type), midSlot.number };
+        if (midSlot.type == LUA_TSTRING) {
+            midKey.str = string(midSlot);
+        }
+        int cmp = compare(key, midKey);
+        if (cmp == 0) {
+            value = slot(hash + mid * 2 * SlotSize + SlotSize);
+            return;
+        }
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+}
+
+void PublishSnapshot(const std::string& name, std::shared_ptr<const DataSnapshot> snapshot)
+{
+    auto lock = std::lock_guard(published_mtx);
+    if (snapshot) {
+        published[name] = std::move(snapshot);
+    } else {
+        published.erase(name);
+    }
+}
+
+std::shared_ptr<const DataSnapshot> FindSnapshot(const std::string& name)
+{
+    auto lock = std::lock_guard(published_mtx);
+    auto iter = published.find(name);
+    return iter != published.end() ? iter->second : nullptr;
+}
+
+size_t PublishedSnapshotBytes()
+{
+    auto lock = std::lock_guard(published_mtx);
+    size_t bytes = 0;
+    for (const auto& [name, snapshot] : published) {
+        bytes += snapshot->byteSize();
+    }
+    return bytes;
+}
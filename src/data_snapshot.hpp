@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+extern "C" {
+    #include "lua.h"
+}
+
+// Immutable copy of a tree of Lua tables, laid out in one contiguous buffer
+// that any number of threads can read at once. Nothing in it points outside
+// the buffer, so a snapshot frozen from the main state is read in place by
+// every subscript worker instead of being copied into each of their states.
+//
+// A table is a header with its array and hash part sizes, the array part as
+// value slots for keys 1..n, and then the hash part as key/value slot pairs
+// sorted by key, looked up by binary search. Strings are stored once however
+// often they appear, and a table reached twice is stored once.
+class DataSnapshot
+{
+public:
+    struct Slot
+    {
+        uint32_t type = LUA_TNIL;
+        // String length.
+        uint32_t size = 0;
+        // Number or boolean value, or offset of the string or table.
+        union {
+            double number = 0.0;
+            uint64_t offset;
+        };
+    };
+
+    struct Key
+    {
+        int type = LUA_TNIL;
+        double number = 0.0;
+        std::string_view str;
+    };
+
+    // Freezes the table at `idx`. Keys may be booleans, numbers and strings,
+    // values those and tables. Returns null and sets `error` on anything
+    // else.
+    static std::shared_ptr<const DataSnapshot> freeze(lua_State* L, int idx, std::string& error);
+
+    // Offset of the table that was frozen.
+    uint64_t root() const {
+        return 0;
+    }
+
+    // Leaves `value` nil if there is no such key.
+    void lookup(uint64_t table, const Key& key, Slot& value) const;
+    // Size of the array part, which is what # gave on the original.
+    uint32_t length(uint64_t table) const;
+    // Array part first, then the hash part.
+    uint32_t entryCount(uint64_t table) const;
+    void entry(uint64_t table, uint32_t i, Slot& key, Slot& value) const;
+
+    std::string_view string(const Slot& slot) const {
+        return std::string_view(_data.data() + slot.offset, slot.size);
+    }
+
+    // Stable for the snapshot's lifetime, a table's identity.
+    const void* address(uint64_t offset) const {
+        return _data.data() + offset;
+    }
+
+    size_t byteSize() const {
+        return _data.size();
+    }
+
+private:
+    friend struct SnapshotFreezer;
+
+    Slot slot(uint64_t offset) const;
+
+    std::string _data;
+};
+
+// Process-wide snapshots by name, visible from every Lua state. Publishing
+// null removes the name; views of a replaced snapshot keep it alive.
+void PublishSnapshot(const std::string& name, std::shared_ptr<const DataSnapshot> snapshot);
+std::shared_ptr<const DataSnapshot> FindSnapshot(const std::string& name);
+// Total size of the snapshots published right now.
+size_t PublishedSnapshotBytes();
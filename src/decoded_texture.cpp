@@ -0,0 +1,276 @@
+#include "decoded_texture.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include <QCryptographicHash>
+#include <QImageReader>
+#include <zlib.h>
+
+#include "block_compression.hpp"
+
+namespace {
+
+constexpr int MaxPackedLevels = 32;
+constexpr int MaxPackedDimension = 1 << 16;
+
+// 2x2 box filter. Odd edges reuse the last row/column.
+QImage HalveImage(const QImage& src)
+{
+    const int w = std::max(1, src.width() / 2);
+    const int h = std::max(1, src.height() / 2);
+    QImage dst(w, h, src.format());
+    for (int y = 0; y < h; ++y) {
+        const uchar* r0 = src.constScanLine(std::min(2 * y, src.height() - 1));
+        const uchar* r1 = src.constScanLine(std::min(2 * y + 1, src.height() - 1));
+        uchar* out = dst.scanLine(y);
+        for (int x = 0; x < w; ++x) {
+            const int x0 = std::min(2 * x, src.width() - 1) * 4;
+            const int x1 = std::min(2 * x + 1, src.width() - 1) * 4;
+            for (int c = 0; c < 4; ++c) {
+                out[x * 4 + c] = (r0[x0 + c] + r0[x1 + c] + r1[x0 + c] + r1[x1 + c] + 2) / 4;
+            }
+        }
+    }
+    return dst;
+}
+
+size_t BlockSize(TextureEncoding encoding)
+{
+    return encoding == TextureEncoding::BC1 ? 8 : 16;
+}
+
+bool IsOpaque(const QImage& img)
+{
+    if (!img.hasAlphaChannel()) {
+        return true;
+    }
+    for (int y = 0; y < img.height(); ++y) {
+        const uchar* row = img.constScanLine(y);
+        for (int x = 0; x < img.width(); ++x) {
+            if (row[x * 4 + 3] != 255) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Expects RGBA8888. Partial blocks at the right and bottom edges repeat the
+// last column/row.
+TextureLevel EncodeLevel(const QImage& img, TextureEncoding encoding)
+{
+    TextureLevel level{ .width = img.width(), .height = img.height() };
+    if (encoding == TextureEncoding::RGBA8) {
+        level.data = QByteArray(reinterpret_cast<const char*>(img.constBits()), img.sizeInBytes());
+        return level;
+    }
+
+    level.data.resize(static_cast<qsizetype>(EncodedLevelSize(encoding, img.width(), img.height())));
+    auto* dst = reinterpret_cast<uint8_t*>(level.data.data());
+    uint8_t block[64];
+    for (int by = 0; by < img.height(); by += 4) {
+        for (int bx = 0; bx < img.width(); bx += 4) {
+            for (int y = 0; y < 4; ++y) {
+                const uchar* row = img.constScanLine(std::min(by + y, img.height() - 1));
+                for (int x = 0; x < 4; ++x) {
+                    std::memcpy(block + (y * 4 + x) * 4, row + std::min(bx + x, img.width() - 1) * 4, 4);
+                }
+            }
+            if (encoding == TextureEncoding::BC1) {
+                CompressBlockBC1(block, dst);
+            } else {
+                CompressBlockBC3(block, dst);
+            }
+            dst += BlockSize(encoding);
+        }
+    }
+    return level;
+}
+
+bool InflateExact(z_stream& z, void* dst, size_t size)
+{
+    z.next_out = static_cast<Bytef*>(dst);
+    z.avail_out = static_cast<uInt>(size);
+    while (z.avail_out > 0) {
+        int err = inflate(&z, Z_NO_FLUSH);
+        if (err == Z_STREAM_END) {
+            return z.avail_out == 0;
+        }
+        if (err != Z_OK) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+
+int DecodedTexture::row_count(int level) const
+{
+    return (levels[level].height + row_height() - 1) / row_height();
+}
+
+size_t DecodedTexture::row_bytes(int level) const
+{
+    if (!compressed()) {
+        return static_cast<size_t>(levels[level].width) * 4;
+    }
+    return static_cast<size_t>((levels[level].width + 3) / 4) * BlockSize(encoding);
+}
+
+size_t DecodedTexture::byte_size() const
+{
+    size_t size = 0;
+    for (const auto& level : levels) {
+        size += level.data.size();
+    }
+    return size;
+}
+
+QImage DecodedTexture::image(int level) const
+{
+    const auto& l = levels[level];
+    return QImage(reinterpret_cast<const uchar*>(l.data.constData()), l.width, l.height,
+                  l.width * 4, QImage::Format_RGBA8888);
+}
+
+size_t EncodedLevelSize(TextureEncoding encoding, int width, int height)
+{
+    if (encoding == TextureEncoding::RGBA8) {
+        return static_cast<size_t>(width) * height * 4;
+    }
+    return static_cast<size_t>((width + 3) / 4) * ((height + 3) / 4) * BlockSize(encoding);
+}
+
+std::unique_ptr<DecodedTexture> DecodeTexture(const QString& path, QSize size, bool mipmaps, bool compress)
+{
+    QImageReader reader(path);
+    if (size.isValid() && !size.isEmpty() && size != reader.size()) {
+        reader.setScaledSize(size);
+    }
+    QImage img = reader.read();
+    if (img.isNull()) {
+        return nullptr;
+    }
+
+    auto tex = std::make_unique<DecodedTexture>();
+    QImage base = img.convertToFormat(QImage::Format_RGBA8888);
+    if (compress) {
+        tex->encoding = IsOpaque(base) ? TextureEncoding::BC1 : TextureEncoding::BC3;
+    }
+    tex->levels.push_back(EncodeLevel(base, tex->encoding));
+    if (!mipmaps) {
+        return tex;
+    }
+
+    // Downsample premultiplied so fully transparent texels don't bleed their
+    // colour into the smaller levels.
+    QImage level = img.convertToFormat(QImage::Format_RGBA8888_Premultiplied);
+    while (level.width() > 1 || level.height() > 1) {
+        level = HalveImage(level);
+        tex->levels.push_back(EncodeLevel(level.convertToFormat(QImage::Format_RGBA8888), tex->encoding));
+    }
+    return tex;
+}
+
+QByteArray ContentHash(const DecodedTexture& tex)
+{
+    // Images with equal hashes share a texture without their pixels ever
+    // being compared, so this has to be collision resistant. The mip
+    // levels derive from the first one, so only their sizes are mixed in.
+    std::vector<int32_t> header;
+    header.push_back(static_cast<int32_t>(tex.encoding));
+    header.push_back(static_cast<int32_t>(tex.levels.size()));
+    for (const auto& level : tex.levels) {
+        header.push_back(level.width);
+        header.push_back(level.height);
+    }
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(QByteArray(reinterpret_cast<const char*>(header.data()), static_cast<qsizetype>(header.size() * sizeof(int32_t))));
+    hash.addData(tex.levels.front().data);
+    return hash.result();
+}
+
+std::shared_ptr<const QByteArray> PackTexture(const DecodedTexture& tex)
+{
+    // Header: encoding and level count followed by the width and height of
+    // each level.
+    std::vector<int32_t> header;
+    header.push_back(static_cast<int32_t>(tex.encoding));
+    header.push_back(static_cast<int32_t>(tex.levels.size()));
+    for (const auto& level : tex.levels) {
+        header.push_back(level.width);
+        header.push_back(level.height);
+    }
+
+    z_stream z{};
+    if (deflateInit(&z, Z_BEST_SPEED) != Z_OK) {
+        return nullptr;
+    }
+    const size_t header_size = header.size() * sizeof(int32_t);
+    auto out = std::make_shared<QByteArray>();
+    out->resize(static_cast<qsizetype>(deflateBound(&z, header_size + tex.byte_size())));
+    z.next_out = reinterpret_cast<Bytef*>(out->data());
+    z.avail_out = static_cast<uInt>(out->size());
+
+    z.next_in = reinterpret_cast<Bytef*>(header.data());
+    z.avail_in = static_cast<uInt>(header_size);
+    int err = deflate(&z, Z_NO_FLUSH);
+    for (const auto& level : tex.levels) {
+        if (err != Z_OK) {
+            break;
+        }
+        z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(level.data.constData()));
+        z.avail_in = static_cast<uInt>(level.data.size());
+        err = deflate(&z, Z_NO_FLUSH);
+    }
+    if (err == Z_OK) {
+        err = deflate(&z, Z_FINISH);
+    }
+    deflateEnd(&z);
+    if (err != Z_STREAM_END) {
+        return nullptr;
+    }
+    out->resize(static_cast<qsizetype>(z.total_out));
+    out->squeeze();
+    return out;
+}
+
+std::unique_ptr<DecodedTexture> UnpackTexture(const QByteArray& packed)
+{
+    z_stream z{};
+    if (inflateInit(&z) != Z_OK) {
+        return nullptr;
+    }
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(packed.constData()));
+    z.avail_in = static_cast<uInt>(packed.size());
+
+    auto tex = std::make_unique<DecodedTexture>();
+    int32_t encoding = 0;
+    int32_t count = 0;
+    bool ok = InflateExact(z, &encoding, sizeof(encoding))
+        && encoding >= static_cast<int32_t>(TextureEncoding::RGBA8)
+        && encoding <= static_cast<int32_t>(TextureEncoding::BC3);
+    ok = ok && InflateExact(z, &count, sizeof(count)) && count > 0 && count <= MaxPackedLevels;
+    tex->encoding = static_cast<TextureEncoding>(encoding);
+    std::vector<int32_t> sizes(ok ? count * 2 : 0);
+    ok = ok && InflateExact(z, sizes.data(), sizes.size() * sizeof(int32_t));
+    for (int32_t i = 0; ok && i < count; ++i) {
+        const int32_t w = sizes[i * 2];
+        const int32_t h = sizes[i * 2 + 1];
+        ok = w > 0 && h > 0 && w <= MaxPackedDimension && h <= MaxPackedDimension;
+        if (ok) {
+            TextureLevel level{ .width = w, .height = h };
+            level.data.resize(static_cast<qsizetype>(EncodedLevelSize(tex->encoding, w, h)));
+            ok = InflateExact(z, level.data.data(), level.data.size());
+            tex->levels.push_back(std::move(level));
+        }
+    }
+    inflateEnd(&z);
+    if (!ok) {
+        return nullptr;
+    }
+    return tex;
+}
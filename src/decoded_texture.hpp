@@ -0,0 +1,74 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <QByteArray>
+#include <QImage>
+#include <QSize>
+#include <QString>
+
+enum class TextureEncoding : int32_t {
+    RGBA8,
+    // S3TC blocks, only produced when the driver can sample them.
+    BC1,
+    BC3,
+};
+
+struct TextureLevel
+{
+    int width = 0;
+    int height = 0;
+    QByteArray data;
+};
+
+// Pixels in the exact layout the uploader hands to GL, one level per mip
+// starting at full size. RGBA8 levels are tightly packed rows, compressed
+// levels are rows of 4x4 blocks.
+struct DecodedTexture
+{
+    TextureEncoding encoding = TextureEncoding::RGBA8;
+    std::vector<TextureLevel> levels;
+    // zlib compressed copy of the levels, kept CPU side for fast re-upload
+    // after the GPU texture has been evicted.
+    std::shared_ptr<const QByteArray> packed;
+    // ContentHash() of the levels, filled in by the loader.
+    QByteArray content_hash;
+
+    int width() const {
+        return levels.front().width;
+    }
+
+    int height() const {
+        return levels.front().height;
+    }
+
+    bool compressed() const {
+        return encoding != TextureEncoding::RGBA8;
+    }
+
+    // Uploads are done in rows: a row of pixels, or a row of blocks.
+    int row_height() const {
+        return compressed() ? 4 : 1;
+    }
+
+    int row_count(int level) const;
+    size_t row_bytes(int level) const;
+    size_t byte_size() const;
+
+    // Non owning view of an RGBA8 level, only valid while this texture lives.
+    QImage image(int level) const;
+};
+
+size_t EncodedLevelSize(TextureEncoding encoding, int width, int height);
+
+// Runs on the loader thread, returns nullptr if the file can't be decoded.
+// A valid `size` smaller than the file scales the image down while decoding.
+// With `compress` set, opaque images become BC1 and the rest BC3.
+std::unique_ptr<DecodedTexture> DecodeTexture(const QString& path, QSize size, bool mipmaps, bool compress);
+
+// SHA-1 of the pixels, equal for images that decode identically.
+QByteArray ContentHash(const DecodedTexture& tex);
+
+std::shared_ptr<const QByteArray> PackTexture(const DecodedTexture& tex);
+std::unique_ptr<DecodedTexture> UnpackTexture(const QByteArray& packed);
@@ -0,0 +1,29 @@
+#include "disk_cache.hpp"
+
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+
+void PruneDiskCache(const QString& dir, const QString& suffix, qint64 max_bytes, int max_age_days)
+{
+    const QDateTime oldest = QDateTime::currentDateTime().addDays(-max_age_days);
+    // Most recently used first.
+    const QFileInfoList entries = QDir(dir).entryInfoList({ "*" + suffix }, QDir::Files, QDir::Time);
+    qint64 kept_bytes = 0;
+    bool full = false;
+    for (const QFileInfo& entry : entries) {
+        full = full || entry.lastModified() < oldest || kept_bytes + entry.size() > max_bytes;
+        if (full) {
+            QFile::remove(entry.absoluteFilePath());
+        } else {
+            kept_bytes += entry.size();
+        }
+    }
+}
+
+void TouchDiskCacheEntry(QFileDevice& file)
+{
+    // Best effort, a failure only makes the entry look older than it is.
+    file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+}
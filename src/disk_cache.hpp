@@ -0,0 +1,18 @@
+#pragma once
+
+#include <QString>
+
+class QFileDevice;
+
+// Upkeep for the caches kept under userPath. An entry's modification time
+// doubles as its last use: readers touch entries they hit, and pruning
+// drops the least recently used ones first. Entries whose source changed
+// are never hit again, so they age out the same way.
+
+// Deletes the `suffix` entries in `dir` not used for `max_age_days`, then
+// the least recently used ones until the rest fit in `max_bytes`. Nothing
+// may be using the cache meanwhile.
+void PruneDiskCache(const QString& dir, const QString& suffix, qint64 max_bytes, int max_age_days);
+
+// Marks an entry open for reading as just used.
+void TouchDiskCacheEntry(QFileDevice& file);
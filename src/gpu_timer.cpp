@@ -0,0 +1,121 @@
+#include "gpu_timer.hpp"
+
+#include <QOpenGLContext>
+#include <QOpenGLExtraFunctions>
+
+#include "trace_recorder.hpp"
+
+#ifndef GL_TIME_ELAPSED
+#define GL_TIME_ELAPSED 0x88BF
+#endif
+
+void GpuTimer::initialize(QOpenGLContext* context)
+{
+    _supported = context->format().version() >= qMakePair(3, 3)
+        || context->hasExtension("GL_ARB_timer_query")
+        || context->hasExtension("GL_EXT_timer_query");
+}
+
+void GpuTimer::cleanup()
+{
+    if (!_supported) {
+        return;
+    }
+    auto* gl = QOpenGLContext::currentContext()->extraFunctions();
+    for (auto& frame : _in_flight) {
+        for (auto& q : frame.queries) {
+            _free_queries.push_back(q.query);
+        }
+    }
+    _in_flight.clear();
+    _current = nullptr;
+    if (!_free_queries.empty()) {
+        gl->glDeleteQueries(static_cast<GLsizei>(_free_queries.size()), _free_queries.data());
+        _free_queries.clear();
+    }
+}
+
+void GpuTimer::begin_frame(uint64_t frame, bool enabled)
+{
+    if (!_supported) {
+        return;
+    }
+    read_back();
+    if (enabled && _in_flight.size() < MaxFramesInFlight) {
+        _in_flight.push_back({ .frame = frame });
+        _current = &_in_flight.back();
+    }
+}
+
+void GpuTimer::begin_layer(int layer, int sub_layer)
+{
+    if (_current == nullptr) {
+        return;
+    }
+    auto* gl = QOpenGLContext::currentContext()->extraFunctions();
+    GLuint query = take_query();
+    gl->glBeginQuery(GL_TIME_ELAPSED, query);
+    _current->queries.push_back({ .layer = layer, .sub_layer = sub_layer, .query = query });
+    _in_layer = true;
+}
+
+void GpuTimer::end_layer()
+{
+    if (!_in_layer) {
+        return;
+    }
+    QOpenGLContext::currentContext()->extraFunctions()->glEndQuery(GL_TIME_ELAPSED);
+    _in_layer = false;
+}
+
+void GpuTimer::end_frame()
+{
+    end_layer();
+    if (_current != nullptr && _current->queries.empty()) {
+        _in_flight.pop_back();
+    }
+    _current = nullptr;
+}
+
+void GpuTimer::read_back()
+{
+    auto* gl = QOpenGLContext::currentContext()->extraFunctions();
+    while (!_in_flight.empty()) {
+        auto& frame = _in_flight.front();
+        // Queries complete in order, the last one done means all are.
+        GLuint available = 0;
+        gl->glGetQueryObjectuiv(frame.queries.back().query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            return;
+        }
+        _layer_times.clear();
+        for (auto& q : frame.queries) {
+            // 32 bits of nanoseconds are a bit over four seconds, plenty
+            // for one layer.
+            GLuint nsecs = 0;
+            gl->glGetQueryObjectuiv(q.query, GL_QUERY_RESULT, &nsecs);
+            _layer_times.push_back({ .layer = q.layer, .sub_layer = q.sub_layer, .nsecs = nsecs });
+            _free_queries.push_back(q.query);
+        }
+        _timed_frame = frame.frame;
+        _in_flight.pop_front();
+
+        if (traceRecorder.enabled()) {
+            for (auto& t : _layer_times) {
+                traceRecorder.counter("gpu", QString("layer %1.%2").arg(t.layer).arg(t.sub_layer), t.nsecs / 1e6);
+            }
+        }
+    }
+}
+
+GLuint GpuTimer::take_query()
+{
+    if (_free_queries.empty()) {
+        GLuint query = 0;
+        QOpenGLContext::currentContext()->extraFunctions()->glGenQueries(1, &query);
+        return query;
+    }
+    GLuint query = _free_queries.back();
+    _free_queries.pop_back();
+    return query;
+}
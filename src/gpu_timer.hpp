@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include <qopengl.h>
+
+class QOpenGLContext;
+
+// GPU time spent on each draw layer, from GL_TIME_ELAPSED queries around
+// every layer paintGL submits. Results are read back without waiting, a few
+// frames after the fact; if the GPU falls further behind than
+// MaxFramesInFlight, frames go untimed until it catches up.
+//
+// Needs GL 3.3, ARB_timer_query or EXT_timer_query, which Mesa's software
+// rasterizers and the Intel drivers all provide. The GUI thread only, with
+// the window's context current.
+class GpuTimer
+{
+public:
+    static constexpr size_t MaxFramesInFlight = 4;
+
+    struct LayerTime
+    {
+        int layer;
+        int sub_layer;
+        uint64_t nsecs;
+    };
+
+    void initialize(QOpenGLContext* context);
+    void cleanup();
+
+    bool supported() const {
+        return _supported;
+    }
+
+    // Whether the frame being submitted is timed.
+    bool timing() const {
+        return _current != nullptr;
+    }
+
+    // Reads back whichever earlier frames have finished, then starts timing
+    // this one if `enabled`.
+    void begin_frame(uint64_t frame, bool enabled);
+    // Layers must not overlap, and no glBegin may be open across either call.
+    void begin_layer(int layer, int sub_layer);
+    void end_layer();
+    void end_frame();
+
+    // Layers of the latest frame read back, in submission order.
+    const std::vector<LayerTime>& layer_times() const {
+        return _layer_times;
+    }
+    // Frame the layer times belong to.
+    uint64_t timed_frame() const {
+        return _timed_frame;
+    }
+
+private:
+    struct Query
+    {
+        int layer;
+        int sub_layer;
+        GLuint query;
+    };
+
+    struct Frame
+    {
+        uint64_t frame;
+        std::vector<Query> queries;
+    };
+
+    void read_back();
+    GLuint take_query();
+
+    bool _supported = false;
+    std::deque<Frame> _in_flight;
+    // Set between begin_frame and end_frame while this frame is timed.
+    Frame* _current = nullptr;
+    bool _in_layer = false;
+    std::vector<GLuint> _free_queries;
+    std::vector<LayerTime> _layer_times;
+    uint64_t _timed_frame = 0;
+};
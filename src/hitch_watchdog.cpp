@@ -0,0 +1,182 @@
+#include "hitch_watchdog.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+#include <QSaveFile>
+
+extern "C" {
+    #include "lua.h"
+    #include "lauxlib.h"
+}
+
+HitchWatchdog hitchWatchdog;
+
+HitchWatchdog::Scope::Scope(const char* callback)
+{
+    hitchWatchdog.begin(callback);
+}
+
+HitchWatchdog::Scope::~Scope()
+{
+    hitchWatchdog.end();
+}
+
+HitchWatchdog::~HitchWatchdog()
+{
+    stop();
+}
+
+void HitchWatchdog::start(lua_State* L)
+{
+    {
+        auto lock = std::lock_guard(_mtx);
+        if (_running) {
+            return;
+        }
+        _L = L;
+        _running = true;
+    }
+    _thread = std::thread([this] { watch_loop(); });
+}
+
+void HitchWatchdog::stop()
+{
+    {
+        auto lock = std::lock_guard(_mtx);
+        _running = false;
+    }
+    _cond.notify_all();
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+}
+
+void HitchWatchdog::set_threshold(int msecs)
+{
+    {
+        auto lock = std::lock_guard(_mtx);
+        _threshold = std::chrono::milliseconds(std::max(msecs, 0));
+    }
+    _cond.notify_all();
+}
+
+int HitchWatchdog::threshold() const
+{
+    auto lock = std::lock_guard(_mtx);
+    return static_cast<int>(_threshold.count());
+}
+
+void HitchWatchdog::begin(const char* callback)
+{
+    {
+        auto lock = std::lock_guard(_mtx);
+        if (_depth++ > 0) {
+            return;
+        }
+        _callback = callback;
+        _since = Clock::now();
+        _generation++;
+    }
+    _cond.notify_all();
+}
+
+void HitchWatchdog::end()
+{
+    double msecs = 0.0;
+    QString callback;
+    {
+        auto lock = std::lock_guard(_mtx);
+        if (_depth == 0 || --_depth > 0) {
+            return;
+        }
+        msecs = std::chrono::duration<double, std::milli>(Clock::now() - _since).count();
+        if (_threshold.count() == 0 || msecs < _threshold.count()) {
+            _traceback.clear();
+            return;
+        }
+        callback = QString::fromLatin1(_callback);
+        if (_hitches.size() == MaxHitches) {
+            _hitches.pop_front();
+        }
+        _hitches.push_back({
+            .when = QDateTime::currentDateTime(),
+            .callback = callback,
+            .msecs = msecs,
+            .traceback = std::move(_traceback),
+        });
+        _traceback.clear();
+    }
+    std::cout << "Hitch: " << callback.toStdString() << " took " << static_cast<int>(msecs) << " ms" << std::endl;
+}
+
+void HitchWatchdog::watch_loop()
+{
+    auto lock = std::unique_lock(_mtx);
+    while (_running) {
+        if (_depth == 0 || _threshold.count() == 0 || _armed_generation == _generation) {
+            _cond.wait(lock);
+            continue;
+        }
+        auto deadline = _since + _threshold;
+        if (Clock::now() < deadline) {
+            _cond.wait_until(lock, deadline);
+            continue;
+        }
+        _armed_generation = _generation;
+        _armed_at = Clock::now();
+        // lua_sethook is safe to call on a state running on another thread.
+        // The interpreter checks it on its next instruction, but compiled
+        // traces don't check hooks at all, so Lua running a trace only
+        // notices once it leaves it.
+        lua_sethook(_L, hook, LUA_MASKCOUNT, 1);
+    }
+}
+
+void HitchWatchdog::hook(lua_State* L, lua_Debug*)
+{
+    lua_sethook(L, nullptr, 0, 0);
+    auto& self = hitchWatchdog;
+    Clock::duration delay;
+    {
+        auto lock = std::lock_guard(self._mtx);
+        // Armed for a callback that has returned since.
+        if (self._depth == 0 || self._armed_generation != self._generation) {
+            return;
+        }
+        delay = Clock::now() - self._armed_at;
+    }
+    std::string note;
+    const auto delay_msecs = std::chrono::duration_cast<std::chrono::milliseconds>(delay).count();
+    if (delay_msecs > LateHookMsecs) {
+        // Most likely stuck in a compiled trace or in C until now.
+        note = "hook fired " + std::to_string(delay_msecs) + " ms late, Lua may have moved on";
+    }
+    luaL_traceback(L, L, note.empty() ? nullptr : note.c_str(), 0);
+    self._traceback = lua_tostring(L, -1);
+    lua_pop(L, 1);
+}
+
+std::deque<HitchWatchdog::Hitch> HitchWatchdog::hitches() const
+{
+    auto lock = std::lock_guard(_mtx);
+    return _hitches;
+}
+
+bool HitchWatchdog::dump(const QString& path) const
+{
+    auto list = hitches();
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    for (const auto& hitch : list) {
+        QString header = QString("%1 %2 took %3 ms\n")
+            .arg(hitch.when.toString(Qt::ISODateWithMs), hitch.callback)
+            .arg(hitch.msecs, 0, 'f', 1);
+        file.write(header.toUtf8());
+        std::string traceback = (hitch.traceback.empty() ? "(no Lua traceback)" : hitch.traceback) + "\n\n";
+        file.write(traceback.data(), static_cast<qint64>(traceback.size()));
+    }
+    return file.commit();
+}
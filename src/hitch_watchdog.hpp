@@ -0,0 +1,107 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <QDateTime>
+#include <QString>
+
+struct lua_State;
+struct lua_Debug;
+
+// Catches Lua callbacks on the GUI thread that run long enough to freeze
+// the window, and what Lua was doing at the time.
+//
+// The GUI thread brackets each callback with a Scope, which costs a
+// mutex lock and a notify. A watchdog thread sleeps until the callback's
+// threshold runs out; if it is still running by then, it installs a one-shot
+// count hook on the main state that takes a traceback from wherever Lua is
+// when the hook fires. When the callback returns, its duration and
+// traceback go into a ring buffer of the last MaxHitches hitches.
+//
+// The hook doesn't always fire right away. LuaJIT doesn't check hooks
+// inside compiled traces, only in the interpreter, so a hot loop running as
+// a trace is only caught once it exits the trace, possibly in another
+// function by then. Time spent in C without Lua running, like uploading
+// textures, only gets its traceback once Lua runs again, if at all before
+// the callback ends. Tracebacks taken more than LateHookMsecs after arming
+// say so.
+class HitchWatchdog
+{
+public:
+    static constexpr size_t MaxHitches = 32;
+    static constexpr int DefaultThresholdMsecs = 250;
+    static constexpr int LateHookMsecs = 20;
+
+    struct Hitch
+    {
+        QDateTime when;
+        QString callback;
+        double msecs;
+        // Empty if Lua didn't run again before the callback returned.
+        std::string traceback;
+    };
+
+    // Watches one callback on the GUI thread. Nested scopes are part of the
+    // outermost one.
+    class Scope
+    {
+    public:
+        explicit Scope(const char* callback);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    ~HitchWatchdog();
+
+    // `L` is the main state; its callbacks must run on the calling thread.
+    void start(lua_State* L);
+    void stop();
+
+    // 0 turns the watchdog off.
+    void set_threshold(int msecs);
+    int threshold() const;
+
+    // Oldest first.
+    std::deque<Hitch> hitches() const;
+    // Writes the hitches as text, oldest first.
+    bool dump(const QString& path) const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void begin(const char* callback);
+    void end();
+    void watch_loop();
+    static void hook(lua_State* L, lua_Debug* ar);
+
+    lua_State* _L = nullptr;
+    std::thread _thread;
+    bool _running = false;
+    mutable std::mutex _mtx;
+    std::condition_variable _cond;
+    std::chrono::milliseconds _threshold{ DefaultThresholdMsecs };
+
+    // Guarded by _mtx.
+    int _depth = 0;
+    const char* _callback = nullptr;
+    Clock::time_point _since;
+    // Bumped per outermost callback, so a hook armed for one that has
+    // since returned leaves the next alone.
+    uint64_t _generation = 0;
+    uint64_t _armed_generation = 0;
+    Clock::time_point _armed_at;
+    std::deque<Hitch> _hitches;
+
+    // GUI thread only.
+    std::string _traceback;
+};
+
+extern HitchWatchdog hitchWatchdog;
@@ -1,8 +1,19 @@
 #pragma once
 
+#include <cstdint>
+
+#include <QByteArray>
 #include <QString>
 #include <QSize>
 
+// Texture flags
+enum r_texFlag_e {	
+	TF_CLAMP	= 0x01,	// Clamp texture
+	TF_NOMIPMAP	= 0x02,	// No mipmaps
+	TF_NEAREST	= 0x04,	// Use nearest-pixel magnification instead of linear
+	TF_ASYNC	= 0x08	// Asynchronous loading
+};
+
 enum class LoadState
 {
   NotLoaded,
@@ -16,18 +27,40 @@ struct TextureIndex
 public:
     TextureIndex() = default;
 
-    TextureIndex(size_t idx) : _idx(idx) {}
+    TextureIndex(size_t idx, uint32_t generation = 0) : _idx(idx), _generation(generation) {}
 
     size_t GetIndex() const {
         return _idx;
     }
 
+    uint32_t GetGeneration() const {
+        return _generation;
+    }
+
     bool IsValid() const {
         return _idx != 0;
     }
 
+    bool operator==(const TextureIndex& other) const {
+        return _idx == other._idx && _generation == other._generation;
+    }
+
+    bool operator!=(const TextureIndex& other) const {
+        return !(*this == other);
+    }
+
 private:
     size_t _idx = 0;
+    uint32_t _generation = 0;
+};
+
+// Sub-rectangle of a texture, in texture coordinates.
+struct TextureRegion
+{
+  float u0 = 0.0f;
+  float v0 = 0.0f;
+  float u1 = 1.0f;
+  float v1 = 1.0f;
 };
 
 struct LazyLoadedTexture
@@ -36,4 +69,21 @@ struct LazyLoadedTexture
   QString path;
   QSize size = {1, 1};
   LoadState state = LoadState::NotLoaded;
+  int flags = TF_NOMIPMAP;
+  // Number of live Lua image handles referring to this texture.
+  int handles = 0;
+  // Set once the image is drawn with texture coordinates outside [0, 1],
+  // which needs the wrap mode of a texture of its own.
+  bool no_atlas = false;
+  // Largest size, in device pixels, the whole image would cover on screen
+  // going by the draws seen so far. Empty until the first draw.
+  QSize draw_size = {0, 0};
+  // Resolution of the copy on the GPU, below `size` when it was downscaled
+  // to fit draw_size.
+  QSize loaded_size = {0, 0};
+  // Flags and content hash of the last decoded image, empty before that.
+  QByteArray content_key;
+  // Set when another image turned out to hold the same pixels. Drawing then
+  // goes through that texture, which this one keeps a reference to.
+  TextureIndex alias = 0;
 };
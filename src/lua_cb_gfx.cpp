@@ -2,6 +2,8 @@
 
 #include <QOpenGLTexture>
 
+#include <algorithm>
+#include <cstring>
 #include <memory>
 #include <stdexcept>
 
@@ -17,6 +19,16 @@ extern "C" {
 
 QRegularExpression colourCodes{R"((\^x.{6})|(\^\d))"};
 
+namespace {
+    // GUI thread only, like everything drawing.
+    size_t stringTextureBytes = 0;
+}
+
+size_t StringTextureBytes()
+{
+    return stringTextureBytes;
+}
+
 
 // =============
 // Image Handles
@@ -47,6 +59,7 @@ imgHandle_s* GetImgHandle(lua_State* L, const char* method)
 int l_imgHandleGC(lua_State* L)
 {
     imgHandle_s* imgHandle = GetImgHandle(L, "__gc");
+    pobwindow->ReleaseTexture(imgHandle->tex_idx);
     imgHandle->~imgHandle_s();
     return 0;
 }
@@ -66,10 +79,6 @@ int l_imgHandleLoad(lua_State* L)
         fullFileName = pobwindow->scriptWorkDir + QDir::separator() + fileName;
     }
 
-    auto& img = pobwindow->GetLazyLoadedTexture(fullFileName);
-    imgHandle->tex_idx = img.index;
-
-#if 0
     int flags = TF_NOMIPMAP;
     for (int f = 2; f <= n; f++) {
         if ( !lua_isstring(L, f) ) {
@@ -82,17 +91,25 @@ int l_imgHandleLoad(lua_State* L)
             flags|= TF_CLAMP;
         } else if ( !strcmp(flag, "MIPMAP") ) {
             flags&= ~TF_NOMIPMAP;
+        } else if ( !strcmp(flag, "NEAREST") ) {
+            flags|= TF_NEAREST;
         } else {
             LAssert(L, 0, "imgHandle:Load(): unrecognised flag '%s'", flag);
         }
     }
-#endif
+
+    auto& img = pobwindow->GetLazyLoadedTexture(fullFileName, flags);
+    pobwindow->RetainTexture(img.index);
+    pobwindow->ReleaseTexture(imgHandle->tex_idx);
+    imgHandle->tex_idx = img.index;
     return 0;
 }
 
 int l_imgHandleUnload(lua_State* L)
 {
-  // NOTE: not used in scripts
+    imgHandle_s* imgHandle = GetImgHandle(L, "Unload");
+    pobwindow->ReleaseTexture(imgHandle->tex_idx);
+    imgHandle->tex_idx = 0;
     return 0;
 }
 
@@ -105,8 +122,9 @@ int l_imgHandleIsValid(lua_State* L)
 
 int l_imgHandleIsLoading(lua_State* L)
 {
-  // NOTE: not used in scripts
-    lua_pushboolean(L, false);
+    imgHandle_s* imgHandle = GetImgHandle(L, "IsLoading");
+    auto& img = pobwindow->GetLazyLoadedTexture(imgHandle->tex_idx);
+    lua_pushboolean(L, img.state == LoadState::Loading);
     return 1;
 }
 
@@ -180,6 +198,8 @@ int l_SetDrawLayer(lua_State* L)
 }
 
 void ViewportCmd::execute() {
+    pobwindow->FlushBatch();
+    pobwindow->renderStats.viewportChanges++;
     float ratio = pobwindow->devicePixelRatio();
     int new_x = x * ratio;
     int new_y = (pobwindow->height - h - y) * ratio;
@@ -193,6 +213,11 @@ void ViewportCmd::execute() {
     glLoadIdentity();
 }
 
+void ColorCmd::execute() {
+    glColor4fv(col);
+    pobwindow->renderStats.colorChanges++;
+}
+
 int l_SetViewport(lua_State* L)
 {
     int n = lua_gettop(L);
@@ -235,6 +260,32 @@ int l_SetDrawColor(lua_State* L)
     return 0;
 }
 
+// Images drawn with wrapping texture coordinates can't live in the atlas.
+static void checkAtlasCoords(TextureIndex tex_idx, const float* coords, int count)
+{
+    constexpr float eps = 1e-4f;
+    for (int i = 0; i < count; i++) {
+        if (coords[i] < -eps || coords[i] > 1.0f + eps) {
+            pobwindow->ExcludeFromAtlas(tex_idx);
+            return;
+        }
+    }
+}
+
+// Width and height of the bounding box of four interleaved x, y points.
+static void quadExtent(const float* pts, float& w, float& h)
+{
+    float x0 = pts[0], x1 = pts[0], y0 = pts[1], y1 = pts[1];
+    for (int i = 1; i < 4; i++) {
+        x0 = std::min(x0, pts[i * 2]);
+        x1 = std::max(x1, pts[i * 2]);
+        y0 = std::min(y0, pts[i * 2 + 1]);
+        y1 = std::max(y1, pts[i * 2 + 1]);
+    }
+    w = x1 - x0;
+    h = y1 - y0;
+}
+
 int l_DrawImage(lua_State* L)
 {
     LAssert(L, pobwindow->isDrawing, "DrawImage() called outside of OnFrame");
@@ -245,8 +296,6 @@ int l_DrawImage(lua_State* L)
     if ( !lua_isnil(L, 1) ) {
         auto imgHandle = (imgHandle_s*)lua_touserdata(L, 1);
         tex_idx = imgHandle->tex_idx;
-        // issue load request
-        pobwindow->GetTexture(tex_idx);
     }
     float arg[8];
     if (n > 5) {
@@ -255,29 +304,43 @@ int l_DrawImage(lua_State* L)
             LAssert(L, lua_isnumber(L, i), "DrawImage() argument %d: expected number, got %t", i, i);
             arg[i-2] = (float)lua_tonumber(L, i);
         }
+        checkAtlasCoords(tex_idx, arg + 4, 4);
+        pobwindow->NoteDrawSize(tex_idx, arg[2] / (arg[6] - arg[4]), arg[3] / (arg[7] - arg[5]));
+        // issue load request
+        pobwindow->RequestTexture(tex_idx);
         pobwindow->AppendCmd(std::make_unique<DrawImageCmd>(tex_idx, arg[0], arg[1], arg[2], arg[3], arg[4], arg[5], arg[6], arg[7]));
     } else {
         for (int i = 2; i <= 5; i++) {
             LAssert(L, lua_isnumber(L, i), "DrawImage() argument %d: expected number, got %t", i, i);
             arg[i-2] = (float)lua_tonumber(L, i);
         }
+        pobwindow->NoteDrawSize(tex_idx, arg[2], arg[3]);
+        pobwindow->RequestTexture(tex_idx);
         pobwindow->AppendCmd(std::make_unique<DrawImageCmd>(tex_idx, arg[0], arg[1], arg[2], arg[3]));
     }
     return 0;
 }
 
 void DrawTextureCmd::execute() {
-    this->BindTexture();
-    glBegin(GL_TRIANGLE_FAN);
+    TextureRegion region;
+    QOpenGLTexture& texture = ResolveTexture(region);
+    // Consecutive quads sharing a texture (or an atlas page) go out in one
+    // glBegin/glEnd pair.
+    pobwindow->BatchTexture(texture);
+    const float su = region.u1 - region.u0;
+    const float sv = region.v1 - region.v0;
     for (int v = 0; v < 4; v++) {
-        glTexCoord2d(s[v], t[v]);
+        glTexCoord2d(region.u0 + s[v] * su, region.v0 + t[v] * sv);
         glVertex2d(x[v], y[v]);
     }
-    glEnd();
 }
 
-void DrawImageQuadCmd::BindTexture() {
-    pobwindow->GetTexture(tex).bind();
+QOpenGLTexture& DrawImageQuadCmd::ResolveTexture(TextureRegion& region) {
+    QOpenGLTexture& texture = pobwindow->GetTexture(tex, region);
+    if (&texture == pobwindow->white.get() && tex.IsValid()) {
+        pobwindow->renderStats.whitePlaceholders++;
+    }
+    return texture;
 }
 
 int l_DrawImageQuad(lua_State* L)
@@ -290,7 +353,6 @@ int l_DrawImageQuad(lua_State* L)
     if ( !lua_isnil(L, 1) ) {
         auto imgHandle = (imgHandle_s*)lua_touserdata(L, 1);
         tex_idx = imgHandle->tex_idx;
-        pobwindow->GetTexture(tex_idx);
     }
     float arg[16];
     if (n > 9) {
@@ -299,12 +361,22 @@ int l_DrawImageQuad(lua_State* L)
             LAssert(L, lua_isnumber(L, i), "DrawImageQuad() argument %d: expected number, got %t", i, i);
             arg[i-2] = (float)lua_tonumber(L, i);
         }
+        checkAtlasCoords(tex_idx, arg + 8, 8);
+        float w, h, su, sv;
+        quadExtent(arg, w, h);
+        quadExtent(arg + 8, su, sv);
+        pobwindow->NoteDrawSize(tex_idx, w / su, h / sv);
+        pobwindow->RequestTexture(tex_idx);
         pobwindow->AppendCmd(std::make_unique<DrawImageQuadCmd>(tex_idx, arg[0], arg[1], arg[2], arg[3], arg[4], arg[5], arg[6], arg[7], arg[8], arg[9], arg[10], arg[11], arg[12], arg[13], arg[14], arg[15]));
     } else {
         for (int i = 2; i <= 9; i++) {
             LAssert(L, lua_isnumber(L, i), "DrawImageQuad() argument %d: expected number, got %t", i, i);
             arg[i-2] = (float)lua_tonumber(L, i);
         }
+        float w, h;
+        quadExtent(arg, w, h);
+        pobwindow->NoteDrawSize(tex_idx, w, h);
+        pobwindow->RequestTexture(tex_idx);
         pobwindow->AppendCmd(std::make_unique<DrawImageQuadCmd>(tex_idx, arg[0], arg[1], arg[2], arg[3], arg[4], arg[5], arg[6], arg[7]));
     }
     return 0;
@@ -366,8 +438,10 @@ DrawStringCmd::DrawStringCmd(float X, float Y, int Align, int Size, int Font, co
 
     QString cacheKey = (QString::number(Font) + "_" + QString::number(Size) + "_" + text);
     if (pobwindow->stringCache.contains(cacheKey)) {
+        pobwindow->renderStats.stringCacheHits++;
         tex = *pobwindow->stringCache[cacheKey];
     } else {
+        pobwindow->renderStats.stringCacheMisses++;
         QString fontName;
         switch (Font) {
         case 1:
@@ -396,7 +470,13 @@ DrawStringCmd::DrawStringCmd(float X, float Y, int Align, int Size, int Font, co
             p.setCompositionMode(QPainter::CompositionMode_Plus);
             p.drawText(0, 0, size.width(), size.height(), 0, text);
             p.end();
-            tex.reset(new QOpenGLTexture(brush));
+            // RGBA8 with a full mip chain.
+            size_t bytes = static_cast<size_t>(brush.width()) * brush.height() * 4 * 4 / 3;
+            stringTextureBytes += bytes;
+            tex = std::shared_ptr<QOpenGLTexture>(new QOpenGLTexture(brush), [bytes](QOpenGLTexture* t) {
+                stringTextureBytes -= bytes;
+                delete t;
+            });
         }
         pobwindow->stringCache.insert(cacheKey, new std::shared_ptr<QOpenGLTexture>(tex));
     }
@@ -440,14 +520,30 @@ DrawStringCmd::DrawStringCmd(float X, float Y, int Align, int Size, int Font, co
     t[3] = 1;
 }
 
-void DrawStringCmd::BindTexture()
+void DrawStringCmd::execute()
+{
+    // glGetFloatv isn't allowed between glBegin and glEnd.
+    pobwindow->FlushBatch();
+    float curCol[4];
+    if (col[3] > 0) {
+        glGetFloatv(GL_CURRENT_COLOR, curCol);
+        glColor4fv(col);
+        pobwindow->renderStats.colorChanges++;
+    }
+    DrawTextureCmd::execute();
+    if (col[3] > 0) {
+        glColor4fv(curCol);
+        pobwindow->renderStats.colorChanges++;
+    }
+}
+
+QOpenGLTexture& DrawStringCmd::ResolveTexture(TextureRegion& region)
 {
     if (tex == nullptr) {
         //throw std::runtime_error("str tex is null");
-        pobwindow->white->bind();
-    } else {
-        tex->bind();
+        return *pobwindow->white;
     }
+    return *tex;
 }
 
 int l_DrawString(lua_State* L)
@@ -1,7 +1,13 @@
 #pragma once
 
+#include <cstddef>
+
 struct lua_State;
 
+// GPU memory held by the textures DrawString rendered text into, whether
+// still cached or only referenced by this frame's commands.
+size_t StringTextureBytes();
+
 int l_NewImageHandle(lua_State* L);
 int l_imgHandleGC(lua_State* L);
 int l_imgHandleLoad(lua_State* L) ;
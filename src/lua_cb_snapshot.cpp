@@ -0,0 +1,179 @@
+#include "lua_cb_snapshot.hpp"
+
+#include <memory>
+#include <new>
+#include <string>
+
+extern "C" {
+    #include "lua.h"
+    #include "lauxlib.h"
+}
+
+#include "data_snapshot.hpp"
+#include "lua_utils.hpp"
+#include "pobwindow.hpp"
+
+// A table in a snapshot, as seen from one Lua state. Each state keeps at
+// most one view per table alive, in a weak registry table keyed by the
+// table's address, so walking the same path twice doesn't allocate.
+struct SnapshotView
+{
+    std::shared_ptr<const DataSnapshot> snapshot;
+    uint64_t table;
+};
+
+static void PushSnapshotView(lua_State* L, const std::shared_ptr<const DataSnapshot>& snapshot, uint64_t table)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, "uisnapshotviews");
+    const void* address = snapshot->address(table);
+    lua_pushlightuserdata(L, const_cast<void*>(address));
+    lua_rawget(L, -2);
+    if (!lua_isnil(L, -1)) {
+        lua_remove(L, -2);
+        return;
+    }
+    lua_pop(L, 1);
+    new (lua_newuserdata(L, sizeof(SnapshotView))) SnapshotView{ snapshot, table };
+    lua_getfield(L, LUA_REGISTRYINDEX, "uisnapshotmeta");
+    lua_setmetatable(L, -2);
+    lua_pushlightuserdata(L, const_cast<void*>(address));
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+    lua_remove(L, -2);
+}
+
+static void PushSnapshotSlot(lua_State* L, const std::shared_ptr<const DataSnapshot>& snapshot, const DataSnapshot::Slot& slot)
+{
+    switch (slot.type) {
+    case LUA_TBOOLEAN:
+        lua_pushboolean(L, slot.number != 0.0);
+        break;
+    case LUA_TNUMBER:
+        lua_pushnumber(L, slot.number);
+        break;
+    case LUA_TSTRING: {
+        auto str = snapshot->string(slot);
+        lua_pushlstring(L, str.data(), str.size());
+        break;
+    }
+    case LUA_TTABLE:
+        PushSnapshotView(L, snapshot, slot.offset);
+        break;
+    default:
+        lua_pushnil(L);
+        break;
+    }
+}
+
+static SnapshotView* GetSnapshotView(lua_State* L, int index, const char* method)
+{
+    LAssert(L, pobwindow->IsUserData(L, index, "uisnapshotmeta"), "%s must be used on a snapshot table", method);
+    return static_cast<SnapshotView*>(lua_touserdata(L, index));
+}
+
+int l_FreezeSnapshot(lua_State* L)
+{
+    int n = lua_gettop(L);
+    LAssert(L, n >= 2, "Usage: FreezeSnapshot(name, table)");
+    LAssert(L, lua_isstring(L, 1), "FreezeSnapshot() argument 1: expected string, got %t", 1);
+    LAssert(L, lua_istable(L, 2), "FreezeSnapshot() argument 2: expected table, got %t", 2);
+    std::string error;
+    auto snapshot = DataSnapshot::freeze(L, 2, error);
+    LAssert(L, snapshot != nullptr, "FreezeSnapshot(): %s", error.c_str());
+    lua_pushnumber(L, static_cast<lua_Number>(snapshot->byteSize()));
+    PublishSnapshot(lua_tostring(L, 1), std::move(snapshot));
+    return 1;
+}
+
+int l_GetSnapshot(lua_State* L)
+{
+    int n = lua_gettop(L);
+    LAssert(L, n >= 1, "Usage: GetSnapshot(name)");
+    LAssert(L, lua_isstring(L, 1), "GetSnapshot() argument 1: expected string, got %t", 1);
+    auto snapshot = FindSnapshot(lua_tostring(L, 1));
+    if (!snapshot) {
+        return 0;
+    }
+    PushSnapshotView(L, snapshot, snapshot->root());
+    return 1;
+}
+
+static int l_snapshotNext(lua_State* L)
+{
+    auto view = static_cast<SnapshotView*>(lua_touserdata(L, lua_upvalueindex(1)));
+    auto i = static_cast<uint32_t>(lua_tointeger(L, lua_upvalueindex(2)));
+    uint32_t count = view->snapshot->entryCount(view->table);
+    for (; i < count; i++) {
+        DataSnapshot::Slot key;
+        DataSnapshot::Slot value;
+        view->snapshot->entry(view->table, i, key, value);
+        // Holes in the array part.
+        if (value.type == LUA_TNIL) {
+            continue;
+        }
+        lua_pushinteger(L, i + 1);
+        lua_replace(L, lua_upvalueindex(2));
+        PushSnapshotSlot(L, view->snapshot, key);
+        PushSnapshotSlot(L, view->snapshot, value);
+        return 2;
+    }
+    return 0;
+}
+
+int l_SnapshotPairs(lua_State* L)
+{
+    int n = lua_gettop(L);
+    LAssert(L, n >= 1, "Usage: SnapshotPairs(snapshotTable)");
+    GetSnapshotView(L, 1, "SnapshotPairs()");
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, l_snapshotNext, 2);
+    return 1;
+}
+
+int l_snapshotIndex(lua_State* L)
+{
+    auto view = static_cast<SnapshotView*>(lua_touserdata(L, 1));
+    DataSnapshot::Key key;
+    key.type = lua_type(L, 2);
+    switch (key.type) {
+    case LUA_TBOOLEAN:
+        key.number = lua_toboolean(L, 2);
+        break;
+    case LUA_TNUMBER:
+        key.number = lua_tonumber(L, 2);
+        break;
+    case LUA_TSTRING: {
+        size_t len = 0;
+        const char* str = lua_tolstring(L, 2, &len);
+        key.str = std::string_view(str, len);
+        break;
+    }
+    default:
+        return 0;
+    }
+    DataSnapshot::Slot value;
+    view->snapshot->lookup(view->table, key, value);
+    PushSnapshotSlot(L, view->snapshot, value);
+    return 1;
+}
+
+int l_snapshotNewIndex(lua_State* L)
+{
+    LError(L, "snapshot tables are read-only");
+    return 0;
+}
+
+int l_snapshotLen(lua_State* L)
+{
+    auto view = static_cast<SnapshotView*>(lua_touserdata(L, 1));
+    lua_pushinteger(L, view->snapshot->length(view->table));
+    return 1;
+}
+
+int l_snapshotGC(lua_State* L)
+{
+    auto view = static_cast<SnapshotView*>(lua_touserdata(L, 1));
+    view->~SnapshotView();
+    return 0;
+}
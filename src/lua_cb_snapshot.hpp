@@ -0,0 +1,11 @@
+#pragma once
+
+struct lua_State;
+
+int l_FreezeSnapshot(lua_State* L);
+int l_GetSnapshot(lua_State* L);
+int l_SnapshotPairs(lua_State* L);
+int l_snapshotIndex(lua_State* L);
+int l_snapshotNewIndex(lua_State* L);
+int l_snapshotLen(lua_State* L);
+int l_snapshotGC(lua_State* L);
@@ -0,0 +1,102 @@
+#include "lua_heap.hpp"
+
+#include <algorithm>
+#include <mutex>
+
+extern "C" {
+    #include "lua.h"
+    #include "lauxlib.h"
+}
+
+namespace {
+    struct Registry
+    {
+        std::mutex mtx;
+        std::vector<LuaHeap*> heaps;
+    };
+
+    // Heaps may be globals, so the list can't be one.
+    Registry& Heaps()
+    {
+        static Registry registry;
+        return registry;
+    }
+}
+
+LuaHeap::LuaHeap(const QString& name)
+    : _name(name)
+{
+    auto& registry = Heaps();
+    auto lock = std::lock_guard(registry.mtx);
+    registry.heaps.push_back(this);
+}
+
+LuaHeap::~LuaHeap()
+{
+    auto& registry = Heaps();
+    auto lock = std::lock_guard(registry.mtx);
+    registry.heaps.erase(std::remove(registry.heaps.begin(), registry.heaps.end(), this), registry.heaps.end());
+}
+
+lua_State* LuaHeap::new_state()
+{
+    lua_State* L = luaL_newstate();
+    if (L == nullptr) {
+        return nullptr;
+    }
+    // Whatever the state allocated while being set up is already counted
+    // by its GC.
+    count(0, static_cast<size_t>(lua_gc(L, LUA_GCCOUNT, 0)) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0));
+    _base_alloc = lua_getallocf(L, &_base_ud);
+    lua_setallocf(L, counting_alloc, this);
+    return L;
+}
+
+void LuaHeap::close_state(lua_State* L)
+{
+    // LuaJIT tears its own arena down in one go, but only when it
+    // recognises its allocator.
+    lua_setallocf(L, _base_alloc, _base_ud);
+    lua_close(L);
+    _bytes.store(0, std::memory_order_relaxed);
+}
+
+void* LuaHeap::counting_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    auto* heap = static_cast<LuaHeap*>(ud);
+    void* block = heap->_base_alloc(heap->_base_ud, ptr, osize, nsize);
+    if (block == nullptr && nsize != 0) {
+        return nullptr;
+    }
+    if (ptr == nullptr) {
+        heap->_allocations.store(heap->_allocations.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+    heap->count(ptr != nullptr ? osize : 0, nsize);
+    return block;
+}
+
+void LuaHeap::count(size_t freed, size_t allocated)
+{
+    size_t bytes = _bytes.load(std::memory_order_relaxed) - freed + allocated;
+    _bytes.store(bytes, std::memory_order_relaxed);
+    if (bytes > _peak_bytes.load(std::memory_order_relaxed)) {
+        _peak_bytes.store(bytes, std::memory_order_relaxed);
+    }
+}
+
+std::vector<LuaHeap::Usage> LuaHeap::usage()
+{
+    auto& registry = Heaps();
+    auto lock = std::lock_guard(registry.mtx);
+    std::vector<Usage> usage;
+    usage.reserve(registry.heaps.size());
+    for (auto* heap : registry.heaps) {
+        usage.push_back({
+            .name = heap->_name,
+            .bytes = heap->bytes(),
+            .peak_bytes = heap->_peak_bytes.load(std::memory_order_relaxed),
+            .allocations = heap->_allocations.load(std::memory_order_relaxed),
+        });
+    }
+    return usage;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <QString>
+
+struct lua_State;
+
+// Counts the bytes one Lua state holds, for the memory report. Every live
+// heap is listed by usage().
+//
+// The state keeps LuaJIT's own allocator, LuaHeap only sits in front of it
+// to count. Only the state's own thread allocates, so the counters are
+// updated with plain relaxed stores; other threads may read them at any
+// time.
+class LuaHeap
+{
+public:
+    struct Usage
+    {
+        QString name;
+        // Bytes Lua asked for and still holds.
+        size_t bytes;
+        size_t peak_bytes;
+        uint64_t allocations;
+    };
+
+    explicit LuaHeap(const QString& name);
+    ~LuaHeap();
+
+    LuaHeap(const LuaHeap&) = delete;
+    LuaHeap& operator=(const LuaHeap&) = delete;
+
+    lua_State* new_state();
+    // Closes a state from new_state().
+    void close_state(lua_State* L);
+
+    size_t bytes() const {
+        return _bytes.load(std::memory_order_relaxed);
+    }
+
+    static std::vector<Usage> usage();
+
+private:
+    static void* counting_alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+    void count(size_t freed, size_t allocated);
+
+    QString _name;
+
+    // LuaJIT's allocator.
+    void* (*_base_alloc)(void*, void*, size_t, size_t) = nullptr;
+    void* _base_ud = nullptr;
+
+    std::atomic<size_t> _bytes = 0;
+    std::atomic<size_t> _peak_bytes = 0;
+    std::atomic<uint64_t> _allocations = 0;
+};
@@ -0,0 +1,207 @@
+#include "lua_marshal.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+
+extern "C" {
+    #include "lauxlib.h"
+}
+
+namespace {
+    enum Tag : uint8_t {
+        TagNil,
+        TagFalse,
+        TagTrue,
+        TagNumber,
+        TagString,
+        // Index into the pin list.
+        TagPinned,
+        // Array size hint and entry count, then key/value pairs up to TagEnd.
+        TagTable,
+        // Index of a table already unpacked, in order of appearance.
+        TagTableRef,
+        TagEnd,
+    };
+
+    // Well past any real data, low enough to stay clear of the C stack limit.
+    constexpr int MaxDepth = 100;
+}
+
+struct LuaValueBuffer::Tables
+{
+    std::unordered_map<const void*, uint32_t> index;
+};
+
+template<typename T>
+void LuaValueBuffer::put(T value)
+{
+    _data.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+T LuaValueBuffer::get(size_t& pos) const
+{
+    T value;
+    std::memcpy(&value, _data.data() + pos, sizeof(T));
+    pos += sizeof(T);
+    return value;
+}
+
+bool LuaValueBuffer::pack(lua_State* L, int first, int last)
+{
+    Tables tables;
+    for (int idx = first; idx <= last; idx++) {
+        if (!packValue(L, idx, 0, tables)) {
+            _errorIndex = idx;
+            return false;
+        }
+        _count++;
+    }
+    return true;
+}
+
+bool LuaValueBuffer::packValue(lua_State* L, int idx, int depth, Tables& tables)
+{
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+        put(TagNil);
+        return true;
+    case LUA_TBOOLEAN:
+        put(lua_toboolean(L, idx) ? TagTrue : TagFalse);
+        return true;
+    case LUA_TNUMBER:
+        put(TagNumber);
+        put(static_cast<double>(lua_tonumber(L, idx)));
+        return true;
+    case LUA_TSTRING: {
+        size_t len = 0;
+        const char* str = lua_tolstring(L, idx, &len);
+        if (len >= PinMinSize) {
+            lua_pushvalue(L, idx);
+            _pins.push_back({ str, len, luaL_ref(L, LUA_REGISTRYINDEX) });
+            put(TagPinned);
+            put(static_cast<uint32_t>(_pins.size() - 1));
+        } else {
+            put(TagString);
+            put(static_cast<uint32_t>(len));
+            _data.append(str, len);
+        }
+        return true;
+    }
+    case LUA_TTABLE:
+        return packTable(L, idx, depth, tables);
+    }
+    _error = std::string(lua_typename(L, lua_type(L, idx))) + " values can't be passed between Lua states";
+    return false;
+}
+
+bool LuaValueBuffer::packTable(lua_State* L, int idx, int depth, Tables& tables)
+{
+    auto [iter, inserted] = tables.index.try_emplace(lua_topointer(L, idx), static_cast<uint32_t>(tables.index.size()));
+    if (!inserted) {
+        put(TagTableRef);
+        put(iter->second);
+        return true;
+    }
+    if (depth >= MaxDepth) {
+        _error = "tables are nested too deeply";
+        return false;
+    }
+    if (!lua_checkstack(L, 3)) {
+        _error = "out of stack space";
+        return false;
+    }
+    if (idx < 0) {
+        idx = lua_gettop(L) + idx + 1;
+    }
+
+    put(TagTable);
+    put(static_cast<uint32_t>(lua_objlen(L, idx)));
+    size_t countPos = _data.size();
+    put(uint32_t(0));
+    uint32_t entries = 0;
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        int top = lua_gettop(L);
+        if (!packValue(L, top - 1, depth + 1, tables) || !packValue(L, top, depth + 1, tables)) {
+            lua_pop(L, 2);
+            return false;
+        }
+        lua_pop(L, 1);
+        entries++;
+    }
+    put(TagEnd);
+    std::memcpy(_data.data() + countPos, &entries, sizeof(entries));
+    return true;
+}
+
+int LuaValueBuffer::unpack(lua_State* L) const
+{
+    lua_checkstack(L, _count + 2);
+    // Tables in order of appearance, for TagTableRef.
+    lua_newtable(L);
+    int refs = lua_gettop(L);
+    int tables = 0;
+    size_t pos = 0;
+    for (int i = 0; i < _count; i++) {
+        unpackValue(L, pos, refs, tables);
+    }
+    lua_remove(L, refs);
+    return _count;
+}
+
+void LuaValueBuffer::unpackValue(lua_State* L, size_t& pos, int refs, int& tables) const
+{
+    switch (get<uint8_t>(pos)) {
+    case TagNil:
+        lua_pushnil(L);
+        break;
+    case TagFalse:
+        lua_pushboolean(L, 0);
+        break;
+    case TagTrue:
+        lua_pushboolean(L, 1);
+        break;
+    case TagNumber:
+        lua_pushnumber(L, get<double>(pos));
+        break;
+    case TagString: {
+        auto len = get<uint32_t>(pos);
+        lua_pushlstring(L, _data.data() + pos, len);
+        pos += len;
+        break;
+    }
+    case TagPinned: {
+        const Pin& pin = _pins[get<uint32_t>(pos)];
+        lua_pushlstring(L, pin.data, pin.size);
+        break;
+    }
+    case TagTableRef:
+        lua_rawgeti(L, refs, static_cast<int>(get<uint32_t>(pos)) + 1);
+        break;
+    case TagTable: {
+        auto narr = get<uint32_t>(pos);
+        auto entries = get<uint32_t>(pos);
+        lua_createtable(L, static_cast<int>(narr), entries > narr ? static_cast<int>(entries - narr) : 0);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, refs, ++tables);
+        lua_checkstack(L, 3);
+        while (static_cast<uint8_t>(_data[pos]) != TagEnd) {
+            unpackValue(L, pos, refs, tables);
+            unpackValue(L, pos, refs, tables);
+            lua_rawset(L, -3);
+        }
+        pos++;
+        break;
+    }
+    }
+}
+
+void LuaValueBuffer::releasePins(lua_State* L)
+{
+    for (const Pin& pin : _pins) {
+        luaL_unref(L, LUA_REGISTRYINDEX, pin.ref);
+    }
+    _pins.clear();
+}
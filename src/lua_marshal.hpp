@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+extern "C" {
+    #include "lua.h"
+}
+
+// Flat binary copy of a run of Lua values, for handing them from one Lua
+// state to another. Covers nil, booleans, numbers, strings of any content
+// and tables of those, nested to any reasonable depth. A table reached
+// twice, including through a cycle, comes out as one shared table again.
+// Metatables are not carried over.
+//
+// Strings of PinMinSize bytes or more are not copied into the buffer: they
+// are pinned in the source state's registry and unpack() reads them from
+// there, so they are copied once, straight into the other state. Pinned
+// strings stay alive until releasePins() is called on the source state,
+// from the thread that runs it, once the buffer has been unpacked.
+//
+// A buffer is filled by one thread and read by another, never both at once.
+class LuaValueBuffer
+{
+public:
+    static constexpr size_t PinMinSize = 64 * 1024;
+
+    LuaValueBuffer() = default;
+    LuaValueBuffer(LuaValueBuffer&&) = default;
+    LuaValueBuffer& operator=(LuaValueBuffer&&) = default;
+
+    // Appends the values at stack indices first to last. Stops at the first
+    // value that can't be copied and returns false, error() and errorIndex()
+    // then tell which one and why. Whatever was pinned still needs releasing.
+    bool pack(lua_State* L, int first, int last);
+
+    // Pushes every value onto `L` and returns how many there are.
+    int unpack(lua_State* L) const;
+
+    // `L` must be the state pack() was called on.
+    void releasePins(lua_State* L);
+
+    int count() const {
+        return _count;
+    }
+
+    bool hasPins() const {
+        return !_pins.empty();
+    }
+
+    const std::string& error() const {
+        return _error;
+    }
+
+    int errorIndex() const {
+        return _errorIndex;
+    }
+
+private:
+    struct Pin
+    {
+        const char* data;
+        size_t size;
+        int ref;
+    };
+
+    struct Tables;
+
+    bool packValue(lua_State* L, int idx, int depth, Tables& tables);
+    bool packTable(lua_State* L, int idx, int depth, Tables& tables);
+    void unpackValue(lua_State* L, size_t& pos, int refs, int& tables) const;
+
+    template<typename T>
+    void put(T value);
+    template<typename T>
+    T get(size_t& pos) const;
+
+    std::string _data;
+    std::vector<Pin> _pins;
+    int _count = 0;
+    std::string _error;
+    int _errorIndex = 0;
+};
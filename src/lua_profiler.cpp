@@ -0,0 +1,118 @@
+#include "lua_profiler.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#include <QSaveFile>
+
+extern "C" {
+    #include "lua.h"
+    #include "luajit.h"
+}
+
+LuaProfiler luaProfiler;
+
+namespace {
+    // "src/Modules/CalcPerform.lua" -> "CalcPerform", the way LuaJIT's
+    // profiler names modules.
+    std::string ModuleName(const char* src)
+    {
+        std::string name(src);
+        if (auto slash = name.find_last_of("/\\"); slash != std::string::npos) {
+            name.erase(0, slash + 1);
+        }
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".lua") == 0) {
+            name.resize(name.size() - 4);
+        }
+        return name;
+    }
+}
+
+void LuaProfiler::start(lua_State* L)
+{
+    if (_running) {
+        return;
+    }
+    _running = true;
+    // One sample per millisecond.
+    luaJIT_profile_start(L, "i1", sample, this);
+}
+
+void LuaProfiler::stop(lua_State* L)
+{
+    if (!_running) {
+        return;
+    }
+    luaJIT_profile_stop(L);
+    _running = false;
+}
+
+void LuaProfiler::sample(void* data, lua_State* L, int samples, int vmstate)
+{
+    size_t len = 0;
+    // Negative depth puts the outermost frame first.
+    const char* stack = luaJIT_profile_dumpstack(L, "F;", -MaxDepth, &len);
+    std::string folded = "main;";
+    folded.append(stack, len);
+    // Time the VM spends on itself shows up as a leaf of its own.
+    if (vmstate == 'G') {
+        folded += "[GC];";
+    } else if (vmstate == 'J') {
+        folded += "[JIT compiler];";
+    }
+    folded.pop_back();
+    static_cast<LuaProfiler*>(data)->add(folded, samples);
+}
+
+std::string LuaProfiler::folded_stack(lua_State* L)
+{
+    std::vector<std::string> frames;
+    lua_Debug ar;
+    for (int level = 0; level < MaxDepth && lua_getstack(L, level, &ar); level++) {
+        lua_getinfo(L, "Sn", &ar);
+        std::string frame;
+        if (ar.what[0] == 'C') {
+            frame = ar.name != nullptr ? ar.name : "[C]";
+        } else {
+            frame = ModuleName(ar.short_src) + ":" + (ar.name != nullptr ? ar.name : std::to_string(ar.linedefined));
+        }
+        // ';' separates frames and a space the count, script text chunk
+        // names may contain both.
+        std::replace(frame.begin(), frame.end(), ';', ',');
+        std::replace(frame.begin(), frame.end(), ' ', '_');
+        frames.push_back(std::move(frame));
+    }
+    std::string folded = "subscript";
+    for (auto iter = frames.rbegin(); iter != frames.rend(); ++iter) {
+        folded += ';';
+        folded += *iter;
+    }
+    return folded;
+}
+
+void LuaProfiler::add(const std::string& stack, uint64_t samples)
+{
+    auto lock = std::lock_guard(_mtx);
+    _stacks[stack] += samples;
+}
+
+bool LuaProfiler::write_folded(const QString& path)
+{
+    std::unordered_map<std::string, uint64_t> stacks;
+    {
+        auto lock = std::lock_guard(_mtx);
+        stacks.swap(_stacks);
+    }
+    if (stacks.empty()) {
+        return false;
+    }
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    for (const auto& [stack, samples] : stacks) {
+        std::string line = stack + " " + std::to_string(samples) + "\n";
+        file.write(line.data(), static_cast<qint64>(line.size()));
+    }
+    return file.commit();
+}
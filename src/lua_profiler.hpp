@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <QString>
+
+struct lua_State;
+
+// Sampling profiler for Lua, aggregating call stacks into folded-stack text
+// ("root;caller;callee count" per line) for flamegraph.pl, speedscope or
+// inferno.
+//
+// The main state is sampled by LuaJIT's own profiler, which sees into JIT
+// compiled code. LuaJIT only profiles one VM at a time, so subscript
+// workers are sampled by the pool instead, through a one-shot count hook it
+// installs on every busy worker each interval; their stacks come in
+// through add(). LuaJIT doesn't check hooks inside compiled traces, so a
+// worker running one is only sampled once it exits the trace. The samples
+// missed meanwhile are added then, keeping the totals right, but against
+// the stack the trace exited to: in worker profiles, time in hot compiled
+// code shows up under whatever function it leaves to.
+class LuaProfiler
+{
+public:
+    static constexpr int MaxDepth = 64;
+
+    void start(lua_State* L);
+    void stop(lua_State* L);
+
+    bool running() const {
+        return _running;
+    }
+
+    // Thread safe. `stack` is root first, frames separated by ';'.
+    void add(const std::string& stack, uint64_t samples = 1);
+    // Writes and clears the stacks gathered so far.
+    bool write_folded(const QString& path);
+
+    // Root first stack of `L` from the debug API, for use inside hooks.
+    static std::string folded_stack(lua_State* L);
+
+private:
+    static void sample(void* data, lua_State* L, int samples, int vmstate);
+
+    bool _running = false;
+    std::mutex _mtx;
+    std::unordered_map<std::string, uint64_t> _stacks;
+};
+
+extern LuaProfiler luaProfiler;
@@ -6,6 +6,8 @@
 #include <QClipboard>
 #include <QDateTime>
 #include <QFontDatabase>
+#include <QJsonDocument>
+#include <QSaveFile>
 #include <QtGui/QGuiApplication>
 
 #include <vector>
@@ -18,8 +20,16 @@
 #include "subscript.hpp"
 #include "lua_utils.hpp"
 #include "lua_cb_gfx.hpp"
+#include "hitch_watchdog.hpp"
+#include "lua_cb_snapshot.hpp"
+#include "lua_heap.hpp"
+#include "lua_profiler.hpp"
+#include "memory_report.hpp"
+#include "startup_trace.hpp"
+#include "trace_recorder.hpp"
 
 lua_State *L;
+static LuaHeap mainHeap("main");
 
 
 static constexpr const char* describeLuaError(int err)
@@ -168,11 +178,93 @@ static int l_StripEscapes(lua_State* L)
 
 static int l_GetAsyncCount(lua_State* L)
 {
-//    lua_pushinteger(L, pobwindow->GetTexAsyncCount());
-    lua_pushinteger(L, 0);
+    lua_pushinteger(L, pobwindow->GetTexAsyncCount());
     return 1;
 }
 
+static int l_GetTextureStats(lua_State* L)
+{
+    lua_createtable(L, 0, 3);
+    lua_pushinteger(L, pobwindow->GetTexDedupHits());
+    lua_setfield(L, -2, "dedupHits");
+    lua_pushnumber(L, (lua_Number)pobwindow->textureResidency.vram_bytes());
+    lua_setfield(L, -2, "vramBytes");
+    lua_pushnumber(L, (lua_Number)pobwindow->textureResidency.cpu_bytes());
+    lua_setfield(L, -2, "cpuCopyBytes");
+    return 1;
+}
+
+static int l_GetRenderStats(lua_State* L)
+{
+    // Counters of the last submitted frame.
+    const auto& stats = pobwindow->lastRenderStats;
+    lua_createtable(L, 0, 11);
+    lua_createtable(L, 0, static_cast<int>(stats.commands.size()));
+    for (size_t i = 0; i < stats.commands.size(); i++) {
+        lua_pushinteger(L, stats.commands[i]);
+        lua_setfield(L, -2, RenderStats::CommandNames[i]);
+    }
+    lua_setfield(L, -2, "commandsByType");
+    lua_pushinteger(L, stats.commandCount());
+    lua_setfield(L, -2, "commands");
+    lua_pushinteger(L, stats.drawCalls);
+    lua_setfield(L, -2, "drawCalls");
+    lua_pushinteger(L, stats.textureBinds);
+    lua_setfield(L, -2, "textureBinds");
+    lua_pushinteger(L, stats.colorChanges);
+    lua_setfield(L, -2, "colorChanges");
+    lua_pushinteger(L, stats.viewportChanges);
+    lua_setfield(L, -2, "viewportChanges");
+    lua_pushinteger(L, stats.stringCacheHits);
+    lua_setfield(L, -2, "stringCacheHits");
+    lua_pushinteger(L, stats.stringCacheMisses);
+    lua_setfield(L, -2, "stringCacheMisses");
+    lua_pushinteger(L, stats.textureHits);
+    lua_setfield(L, -2, "textureHits");
+    lua_pushinteger(L, stats.textureMisses);
+    lua_setfield(L, -2, "textureMisses");
+    lua_pushinteger(L, stats.whitePlaceholders);
+    lua_setfield(L, -2, "whitePlaceholders");
+    if (pobwindow->gpuTimer.supported()) {
+        // From a few frames back, once the GPU got through them.
+        const auto& times = pobwindow->gpuTimer.layer_times();
+        lua_createtable(L, static_cast<int>(times.size()), 0);
+        for (size_t i = 0; i < times.size(); i++) {
+            lua_createtable(L, 0, 3);
+            lua_pushinteger(L, times[i].layer);
+            lua_setfield(L, -2, "layer");
+            lua_pushinteger(L, times[i].sub_layer);
+            lua_setfield(L, -2, "subLayer");
+            lua_pushnumber(L, times[i].nsecs / 1e6);
+            lua_setfield(L, -2, "gpuMsecs");
+            lua_rawseti(L, -2, static_cast<int>(i + 1));
+        }
+        lua_setfield(L, -2, "gpuLayers");
+        lua_pushinteger(L, static_cast<lua_Integer>(pobwindow->gpuTimer.timed_frame()));
+        lua_setfield(L, -2, "gpuFrame");
+        lua_pushinteger(L, static_cast<lua_Integer>(pobwindow->frameCount));
+        lua_setfield(L, -2, "frame");
+    }
+    return 1;
+}
+
+static int l_SetGpuTiming(lua_State* L)
+{
+    int n = lua_gettop(L);
+    LAssert(L, n >= 1, "Usage: SetGpuTiming(isEnabled)");
+    pobwindow->gpuTiming = lua_toboolean(L, 1) != 0;
+    return 0;
+}
+
+static int l_SetRenderStatsOverlay(lua_State* L)
+{
+    int n = lua_gettop(L);
+    LAssert(L, n >= 1, "Usage: SetRenderStatsOverlay(isEnabled)");
+    pobwindow->renderStatsOverlay = lua_toboolean(L, 1) != 0;
+    pobwindow->update();
+    return 0;
+}
+
 // ==============
 // Search Handles
 // ==============
@@ -499,49 +591,58 @@ static int l_LaunchSubScript(lua_State* L)
     for (int i = 1; i <= 3; i++) {
         LAssert(L, lua_isstring(L, i), "LaunchSubScript() argument %d: expected string, got %t", i, i);
     }
-    for (int i = 4; i <= n; i++) {
-        LAssert(L, lua_isnil(L, i) || lua_isboolean(L, i) || lua_isnumber(L, i) || lua_isstring(L, i), 
-                           "LaunchSubScript() argument %d: only nil, boolean, number and string types can be passed to sub script", i);
+    auto job = std::make_shared<SubScript>(L);
+    if (!job->argsError().empty()) {
+        job->releaseArgs();
+        LError(L, "LaunchSubScript() argument %d: %s", job->badArg(), job->argsError().c_str());
     }
-    int slot = pobwindow->subScriptList.size();
-    pobwindow->subScriptList.append(std::make_shared<SubScript>(L));
-    // Signal us when the subscript completes so we can trigger a repaint.
-    pobwindow->connect( pobwindow->subScriptList[slot].get(), &SubScript::finished, pobwindow, &POBWindow::subScriptFinished );
-    pobwindow->subScriptList[slot]->start();
-    lua_pushinteger(L, slot);
+    // The pool calls subScriptFinished once it has run, which also repaints.
+    int id = pobwindow->subScriptPool.launch(std::move(job));
+    lua_pushinteger(L, id);
+    return 1;
+}
+
+static int l_LaunchSubScriptMap(lua_State* L)
+{
+    int n = lua_gettop(L);
+    LAssert(L, n >= 4, "Usage: LaunchSubScriptMap(scriptText, funcList, subList, argSets[, ordered])");
+    for (int i = 1; i <= 3; i++) {
+        LAssert(L, lua_isstring(L, i), "LaunchSubScriptMap() argument %d: expected string, got %t", i, i);
+    }
+    LAssert(L, lua_istable(L, 4), "LaunchSubScriptMap() argument 4: expected table, got %t", 4);
+    // Results come in argument set order unless told otherwise.
+    bool ordered = lua_isnoneornil(L, 5) || lua_toboolean(L, 5);
+    auto job = std::make_shared<SubScript>(L, 4, ordered);
+    if (!job->argsError().empty()) {
+        job->releaseArgs();
+        LError(L, "LaunchSubScriptMap() argument set %d: %s", job->badArg(), job->argsError().c_str());
+    }
+    int id = pobwindow->subScriptPool.launch(std::move(job));
+    lua_pushinteger(L, id);
     return 1;
 }
 
 static int l_AbortSubScript(lua_State* L)
 {
-    std::cout << "SUBSCRIPT ABORT STUB" << std::endl;
+    int n = lua_gettop(L);
+    LAssert(L, n >= 1, "Usage: AbortSubScript(ssID)");
+    LAssert(L, lua_isnumber(L, 1), "AbortSubScript() argument 1: expected subscript ID, got %t", 1);
+    int id = (int)lua_tointeger(L, 1);
+    LAssert(L, pobwindow->subScriptPool.isValid(id), "AbortSubScript() argument 1: invalid subscript ID");
+    // Also drops results that are finished but not delivered yet.
+    pobwindow->subScriptPool.abort(id);
     return 0;
-    /*
-        int n = lua_gettop(L);
-      LAssert(L, n >= 1, "Usage: AbortSubScript(ssID)");
-      LAssert(L, lua_islightuserdata(L, 1), "AbortSubScript() argument 1: expected subscript ID, got %t", 1);
-      notdword slot = (notdword)lua_touserdata(L, 1);
-      LAssert(L, slot < pobwindow->subScriptSize && pobwindow->subScriptList[slot], "AbortSubScript() argument 1: invalid subscript ID");
-      LAssert(L, pobwindow->subScriptList[slot]->IsRunning(), "AbortSubScript(): subscript isn't running");
-      ui_ISubScript::FreeHandle(pobwindow->subScriptList[slot]);
-      pobwindow->subScriptList[slot] = NULL;
-      return 0;
-    */
 }
 
 static int l_IsSubScriptRunning(lua_State* L)
 {
-    std::cout << "SUBSCRIPT RUNNING STUB" << std::endl;
-    return 0;
-    /*
-        int n = lua_gettop(L);
-      LAssert(L, n >= 1, "Usage: IsSubScriptRunning(ssID)");
-      LAssert(L, lua_islightuserdata(L, 1), "IsSubScriptRunning() argument 1: expected subscript ID, got %t", 1);
-      notdword slot = (notdword)lua_touserdata(L, 1);
-      LAssert(L, slot < pobwindow->subScriptSize && pobwindow->subScriptList[slot], "IsSubScriptRunning() argument 1: invalid subscript ID");
-      lua_pushboolean(L, pobwindow->subScriptList[slot]->IsRunning());
-      return 1;
-    */
+    int n = lua_gettop(L);
+    LAssert(L, n >= 1, "Usage: IsSubScriptRunning(ssID)");
+    LAssert(L, lua_isnumber(L, 1), "IsSubScriptRunning() argument 1: expected subscript ID, got %t", 1);
+    int id = (int)lua_tointeger(L, 1);
+    LAssert(L, pobwindow->subScriptPool.isValid(id), "IsSubScriptRunning() argument 1: invalid subscript ID");
+    lua_pushboolean(L, pobwindow->subScriptPool.isRunning(id));
+    return 1;
 }
 
 static int l_LoadModule(lua_State* L)
@@ -553,9 +654,8 @@ static int l_LoadModule(lua_State* L)
     if (!fileName.endsWith(".lua")) {
         fileName = fileName + ".lua";
     }
-    QDir::setCurrent(pobwindow->scriptPath);
-    int err = luaL_loadfile(L, fileName.toStdString().c_str());
-    QDir::setCurrent(pobwindow->scriptWorkDir);
+    StartupTrace::Scope trace(startupTrace, StartupTrace::Kind::Module, fileName);
+    int err = pobwindow->moduleCache.load(L, fileName);
     LAssert(L, err == 0, "LoadModule() error loading '%s':\n%s", fileName.toStdString().c_str(), lua_tostring(L, -1));
     lua_replace(L, 1);	// Replace module name with module main chunk
     lua_call(L, n - 1, LUA_MULTRET);
@@ -571,9 +671,8 @@ static int l_PLoadModule(lua_State* L)
     if (!fileName.endsWith(".lua")) {
         fileName = fileName + ".lua";
     }
-    QDir::setCurrent(pobwindow->scriptPath);
-    int err = luaL_loadfile(L, fileName.toStdString().c_str());
-    QDir::setCurrent(pobwindow->scriptWorkDir);
+    StartupTrace::Scope trace(startupTrace, StartupTrace::Kind::Module, fileName);
+    int err = pobwindow->moduleCache.load(L, fileName);
     if (err) {
         return 1;
     }
@@ -751,8 +850,149 @@ static int l_SetProfiling(lua_State* L)
 {
     int n = lua_gettop(L);
     LAssert(L, n >= 1, "Usage: SetProfiling(isEnabled)");
-    // FIXME
-    //pobwindow->debug->SetProfiling(lua_toboolean(L, 1) == 1);
+    if (L != ::L) {
+        // Profiling covers every state, it is only switched from the main one.
+        return 0;
+    }
+    if (lua_toboolean(L, 1)) {
+        if (!traceRecorder.enabled()) {
+            traceRecorder.start();
+        }
+        luaProfiler.start(L);
+        pobwindow->subScriptPool.startSampling();
+        return 0;
+    }
+    luaProfiler.stop(L);
+    pobwindow->subScriptPool.stopSampling();
+    // Returns where the trace and the folded Lua stacks went.
+    QString base = pobwindow->userPath + "/profile-" + QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss");
+    QString tracePath = base + ".json";
+    QString stacksPath = base + ".folded";
+    int ret = 0;
+    if (traceRecorder.stop(tracePath)) {
+        std::cout << "Trace written to " << tracePath.toStdString() << std::endl;
+        lua_pushstring(L, tracePath.toUtf8().constData());
+        ret = 1;
+    }
+    if (luaProfiler.write_folded(stacksPath)) {
+        std::cout << "Lua stacks written to " << stacksPath.toStdString() << std::endl;
+        if (ret == 0) {
+            lua_pushnil(L);
+        }
+        lua_pushstring(L, stacksPath.toUtf8().constData());
+        ret = 2;
+    }
+    return ret;
+}
+
+static int l_SetHitchThreshold(lua_State* L)
+{
+    int n = lua_gettop(L);
+    LAssert(L, n >= 1, "Usage: SetHitchThreshold(msecs)");
+    LAssert(L, lua_isnumber(L, 1), "SetHitchThreshold() argument 1: expected number, got %t", 1);
+    hitchWatchdog.set_threshold((int)lua_tointeger(L, 1));
+    return 0;
+}
+
+static int l_GetHitches(lua_State* L)
+{
+    auto hitches = hitchWatchdog.hitches();
+    lua_createtable(L, static_cast<int>(hitches.size()), 0);
+    int i = 1;
+    for (const auto& hitch : hitches) {
+        lua_createtable(L, 0, 4);
+        lua_pushnumber(L, hitch.when.toMSecsSinceEpoch() / 1000.0);
+        lua_setfield(L, -2, "time");
+        lua_pushstring(L, hitch.callback.toUtf8().constData());
+        lua_setfield(L, -2, "callback");
+        lua_pushnumber(L, hitch.msecs);
+        lua_setfield(L, -2, "msecs");
+        lua_pushlstring(L, hitch.traceback.data(), hitch.traceback.size());
+        lua_setfield(L, -2, "traceback");
+        lua_rawseti(L, -2, i++);
+    }
+    return 1;
+}
+
+static int l_DumpHitches(lua_State* L)
+{
+    QString path = pobwindow->userPath + "/hitches-" + QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss") + ".txt";
+    if (!hitchWatchdog.dump(path)) {
+        return 0;
+    }
+    std::cout << "Hitches written to " << path.toStdString() << std::endl;
+    lua_pushstring(L, path.toUtf8().constData());
+    return 1;
+}
+
+static int l_GetMemoryReport(lua_State* L)
+{
+    auto report = MemoryReport::collect(*pobwindow);
+    lua_createtable(L, 0, 9);
+    lua_createtable(L, static_cast<int>(report.lua_heaps.size()), 0);
+    for (size_t i = 0; i < report.lua_heaps.size(); i++) {
+        const auto& heap = report.lua_heaps[i];
+        lua_createtable(L, 0, 4);
+        lua_pushstring(L, heap.name.toUtf8().constData());
+        lua_setfield(L, -2, "name");
+        lua_pushnumber(L, (lua_Number)heap.bytes);
+        lua_setfield(L, -2, "bytes");
+        lua_pushnumber(L, (lua_Number)heap.peak_bytes);
+        lua_setfield(L, -2, "peakBytes");
+        lua_pushnumber(L, (lua_Number)heap.allocations);
+        lua_setfield(L, -2, "allocations");
+        lua_rawseti(L, -2, static_cast<int>(i + 1));
+    }
+    lua_setfield(L, -2, "luaHeaps");
+    lua_pushnumber(L, (lua_Number)report.string_texture_bytes);
+    lua_setfield(L, -2, "stringTextureBytes");
+    lua_pushnumber(L, (lua_Number)report.texture_vram_bytes);
+    lua_setfield(L, -2, "textureVramBytes");
+    lua_pushnumber(L, (lua_Number)report.texture_cpu_copy_bytes);
+    lua_setfield(L, -2, "textureCpuCopyBytes");
+    lua_pushnumber(L, (lua_Number)report.atlas_bytes);
+    lua_setfield(L, -2, "atlasBytes");
+    lua_pushnumber(L, (lua_Number)report.loader_pending_bytes);
+    lua_setfield(L, -2, "loaderPendingBytes");
+    lua_pushnumber(L, (lua_Number)report.command_buffer_bytes);
+    lua_setfield(L, -2, "commandBufferBytes");
+    lua_pushnumber(L, (lua_Number)report.snapshot_bytes);
+    lua_setfield(L, -2, "snapshotBytes");
+    lua_pushnumber(L, (lua_Number)report.total_bytes());
+    lua_setfield(L, -2, "totalBytes");
+    return 1;
+}
+
+static int l_DumpMemoryReport(lua_State* L)
+{
+    QString path = pobwindow->userPath + "/memory-" + QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss") + ".json";
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return 0;
+    }
+    file.write(QJsonDocument(MemoryReport::collect(*pobwindow).to_json()).toJson());
+    if (!file.commit()) {
+        return 0;
+    }
+    std::cout << "Memory report written to " << path.toStdString() << std::endl;
+    lua_pushstring(L, path.toUtf8().constData());
+    return 1;
+}
+
+static int l_BeginTraceZone(lua_State* L)
+{
+    int n = lua_gettop(L);
+    LAssert(L, n >= 1, "Usage: BeginTraceZone(name)");
+    LAssert(L, lua_isstring(L, 1), "BeginTraceZone() argument 1: expected string, got %t", 1);
+    if (traceRecorder.enabled()) {
+        traceRecorder.begin_zone(QString::fromUtf8(lua_tostring(L, 1)));
+    }
+    return 0;
+}
+
+static int l_EndTraceZone(lua_State* L)
+{
+    traceRecorder.end_zone();
     return 0;
 }
 
@@ -826,8 +1066,31 @@ void RegisterGeneralLuaCallbacks(lua_State* L)
     ADDFUNC(SetWorkDir);
     ADDFUNC(GetWorkDir);
     ADDFUNC(LaunchSubScript);
+    ADDFUNC(LaunchSubScriptMap);
     ADDFUNC(AbortSubScript);
     ADDFUNC(IsSubScriptRunning);
+
+    // Data snapshots, shared between all states
+    ADDFUNC(FreezeSnapshot);
+    ADDFUNC(GetSnapshot);
+    ADDFUNC(SnapshotPairs);
+    lua_newtable(L);	// Snapshot table metatable
+    lua_pushcfunction(L, l_snapshotIndex);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_snapshotNewIndex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, l_snapshotLen);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, l_snapshotGC);
+    lua_setfield(L, -2, "__gc");
+    lua_setfield(L, LUA_REGISTRYINDEX, "uisnapshotmeta");
+    lua_newtable(L);	// Snapshot tables by address, weak values
+    lua_newtable(L);
+    lua_pushstring(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, "uisnapshotviews");
+
     ADDFUNC(LoadModule);
     ADDFUNC(PLoadModule);
     ADDFUNC(PCall);
@@ -842,6 +1105,8 @@ void RegisterGeneralLuaCallbacks(lua_State* L)
     ADDFUNC(SpawnProcess);
     ADDFUNC(OpenURL);
     ADDFUNC(SetProfiling);
+    ADDFUNC(BeginTraceZone);
+    ADDFUNC(EndTraceZone);
     ADDFUNC(Restart);
     ADDFUNC(Exit);
     lua_getglobal(L, "os");
@@ -853,13 +1118,37 @@ void RegisterGeneralLuaCallbacks(lua_State* L)
 
 int main(int argc, char **argv)
 {
+    startupTrace.start();
+    startupTrace.phase("qt_init");
     QCoreApplication::setAttribute(Qt::AA_ShareOpenGLContexts);
     QGuiApplication app{argc, argv};
 
     QStringList args = app.arguments();
+    traceRecorder.set_thread_name("main");
 
+    startupTrace.phase("window");
     pobwindow = new POBWindow;
 
+    // Workers register the general callbacks, which need pobwindow set.
+    pobwindow->subScriptPool.start();
+
+    if (args.removeAll("--no-texture-compression") > 0) {
+        pobwindow->blockCompression = false;
+    }
+    pobwindow->DetectBlockCompression();
+    if (args.removeAll("--render-stats") > 0) {
+        pobwindow->renderStatsOverlay = true;
+    }
+
+    startupTrace.set_report_path(pobwindow->userPath + "/startup-report.json");
+    for (int i = 1; i < args.size(); i++) {
+        if (args[i].startsWith("--startup-report=")) {
+            startupTrace.set_report_path(args[i].mid(17));
+            args.removeAt(i);
+            break;
+        }
+    }
+
     if (args.size() > 1) {
         bool ok;
         int ff = args[1].toInt(&ok);
@@ -869,8 +1158,10 @@ int main(int argc, char **argv)
         }
     }
 
-    L = luaL_newstate();
+    startupTrace.phase("lua_state");
+    L = mainHeap.new_state();
     installPanicHandler(L);
+    hitchWatchdog.start(L);
     luaL_openlibs(L);
 
     // Arguments
@@ -882,6 +1173,7 @@ int main(int argc, char **argv)
     lua_setfield(L, LUA_GLOBALSINDEX, "arg");
 
     // Callbacks
+    startupTrace.phase("callbacks");
     lua_newtable(L);		// Callbacks table
     lua_pushvalue(L, -1);	// Push callbacks table
     ADDFUNCCL(SetCallback, 1);
@@ -927,6 +1219,19 @@ int main(int argc, char **argv)
     ADDFUNC(DrawStringCursorIndex);
     ADDFUNC(StripEscapes);
     ADDFUNC(GetAsyncCount);
+    ADDFUNC(GetTextureStats);
+    ADDFUNC(GetRenderStats);
+    ADDFUNC(SetRenderStatsOverlay);
+    ADDFUNC(SetGpuTiming);
+
+    // Hitch watchdog
+    ADDFUNC(SetHitchThreshold);
+    ADDFUNC(GetHitches);
+    ADDFUNC(DumpHitches);
+
+    // Memory
+    ADDFUNC(GetMemoryReport);
+    ADDFUNC(DumpMemoryReport);
 
     // Search handles
     lua_newtable(L);	// Search handle metatable
@@ -948,21 +1253,29 @@ int main(int argc, char **argv)
 
     RegisterGeneralLuaCallbacks(L);
 
+    startupTrace.phase("launch_script");
     int result = luaL_dofile(L, "src/Launch.lua");
     if (result != 0) {
         lua_error(L);
     }
 
+    startupTrace.phase("on_init");
     pushCallback("OnInit");
     result = lua_pcall(L, 1, 0, 0);
     if (result != 0) {
         lua_error(L);
     }
+    startupTrace.phase("show");
     pobwindow->resize(800, 600);
     pobwindow->show();
+    startupTrace.phase("fonts");
     QFontDatabase::addApplicationFont("VeraMono.ttf");
     QFontDatabase::addApplicationFont("LiberationSans-Regular.ttf");
     QFontDatabase::addApplicationFont("LiberationSans-Bold.ttf");
-    return app.exec();
+    // Ends with the first fully textured frame.
+    startupTrace.phase("first_frame");
+    int exitCode = app.exec();
+    hitchWatchdog.stop();
+    return exitCode;
 }
 
@@ -9,6 +9,7 @@
 #include <QtCore/qmath.h>
 
 #include "lazy_loaded_texture.hpp"
+#include "render_stats.hpp"
 
 
 // Font alignment
@@ -28,18 +29,11 @@ enum r_fonts_e {
 	F_NUMFONTS
 };
 
-// Texture flags
-enum r_texFlag_e {	
-	TF_CLAMP	= 0x01,	// Clamp texture
-	TF_NOMIPMAP	= 0x02,	// No mipmaps
-	TF_NEAREST	= 0x04,	// Use nearest-pixel magnification instead of linear
-	TF_ASYNC	= 0x08	// Asynchronous loading
-};
-
 class Cmd {
   public:
     virtual ~Cmd() = default;
     virtual void execute() = 0;
+    virtual RenderStats::Command kind() const = 0;
 };
 
 class ViewportCmd : public Cmd {
@@ -48,6 +42,9 @@ class ViewportCmd : public Cmd {
     }
 
     void execute();
+    RenderStats::Command kind() const override {
+        return RenderStats::Command::Viewport;
+    }
   private:
     int x, y, w, h;
 };
@@ -55,8 +52,9 @@ class ViewportCmd : public Cmd {
 class ColorCmd : public Cmd {
   public:
   ColorCmd(float Col[4]) : col {Col[0], Col[1], Col[2], Col[3]} {}
-    void execute() {
-        glColor4fv(col);
+    void execute();
+    RenderStats::Command kind() const override {
+        return RenderStats::Command::Color;
     }
   private:
     float col[4];
@@ -74,7 +72,9 @@ public:
 
     void execute();
 
-    virtual void BindTexture() = 0;
+    // Returns the texture to draw with. Atlased images narrow `region` to
+    // their part of the atlas page.
+    virtual QOpenGLTexture& ResolveTexture(TextureRegion& region) = 0;
 
 protected:
     float x[4] = {};
@@ -89,7 +89,10 @@ public:
     DrawImageQuadCmd(TextureIndex Tex, float X0, float Y0, float X1, float Y1, float X2, float Y2, float X3, float Y3, float S0 = 0, float T0 = 0, float S1 = 1, float T1 = 0, float S2 = 1, float T2 = 1, float S3 = 0, float T3 = 1) : DrawTextureCmd(X0, Y0, X1, Y1, X2, Y2, X3, Y3, S0, T0, S1, T1, S2, T2, S3, T3), tex(Tex)
     { }
 
-    void BindTexture() override;
+    QOpenGLTexture& ResolveTexture(TextureRegion& region) override;
+    RenderStats::Command kind() const override {
+        return RenderStats::Command::ImageQuad;
+    }
 
   protected:
     TextureIndex tex = 0;
@@ -99,6 +102,10 @@ class DrawImageCmd : public DrawImageQuadCmd {
   public:
   DrawImageCmd(TextureIndex tex, float x, float y, float w, float h, float s1 = 0, float t1 = 0, float s2 = 1.0f, float t2 = 1.0f) : DrawImageQuadCmd(tex, x, y, x + w, y, x + w, y + h, x, y + h, s1, t1, s2, t1, s2, t2, s1, t2) {
     }
+
+    RenderStats::Command kind() const override {
+        return RenderStats::Command::Image;
+    }
 };
 
 class DrawStringCmd : public DrawTextureCmd {
@@ -107,19 +114,12 @@ class DrawStringCmd : public DrawTextureCmd {
     ~DrawStringCmd() {
     }
 
-    void execute() override {
-        float curCol[4];
-        if (col[3] > 0) {
-            glGetFloatv(GL_CURRENT_COLOR, curCol);
-            glColor4fv(col);
-        }
-        DrawTextureCmd::execute();
-        if (col[3] > 0) {
-            glColor4fv(curCol);
-        }
-    }
+    void execute() override;
 
-    void BindTexture() override;
+    QOpenGLTexture& ResolveTexture(TextureRegion& region) override;
+    RenderStats::Command kind() const override {
+        return RenderStats::Command::String;
+    }
 
     void setCol(float c0, float c1, float c2) {
         col[0] = c0;
@@ -0,0 +1,55 @@
+#include "memory_report.hpp"
+
+#include <QJsonArray>
+
+#include "data_snapshot.hpp"
+#include "lua_cb_gfx.hpp"
+#include "pobwindow.hpp"
+
+MemoryReport MemoryReport::collect(const POBWindow& window)
+{
+    return {
+        .lua_heaps = LuaHeap::usage(),
+        .string_texture_bytes = StringTextureBytes(),
+        .texture_vram_bytes = window.textureResidency.vram_bytes(),
+        .texture_cpu_copy_bytes = window.textureResidency.cpu_bytes(),
+        .atlas_bytes = window.textureAtlas.vram_bytes(),
+        .loader_pending_bytes = window.textureLoader.pending_bytes(),
+        .command_buffer_bytes = window.CommandBufferBytes(),
+        .snapshot_bytes = PublishedSnapshotBytes(),
+    };
+}
+
+size_t MemoryReport::total_bytes() const
+{
+    size_t total = string_texture_bytes + texture_vram_bytes + texture_cpu_copy_bytes + atlas_bytes
+        + loader_pending_bytes + command_buffer_bytes + snapshot_bytes;
+    for (const auto& heap : lua_heaps) {
+        total += heap.bytes;
+    }
+    return total;
+}
+
+QJsonObject MemoryReport::to_json() const
+{
+    QJsonArray heaps;
+    for (const auto& heap : lua_heaps) {
+        heaps.append(QJsonObject{
+            { "name", heap.name },
+            { "bytes", static_cast<qint64>(heap.bytes) },
+            { "peak_bytes", static_cast<qint64>(heap.peak_bytes) },
+            { "allocations", static_cast<qint64>(heap.allocations) },
+        });
+    }
+    return QJsonObject{
+        { "lua_heaps", heaps },
+        { "string_texture_bytes", static_cast<qint64>(string_texture_bytes) },
+        { "texture_vram_bytes", static_cast<qint64>(texture_vram_bytes) },
+        { "texture_cpu_copy_bytes", static_cast<qint64>(texture_cpu_copy_bytes) },
+        { "atlas_bytes", static_cast<qint64>(atlas_bytes) },
+        { "loader_pending_bytes", static_cast<qint64>(loader_pending_bytes) },
+        { "command_buffer_bytes", static_cast<qint64>(command_buffer_bytes) },
+        { "snapshot_bytes", static_cast<qint64>(snapshot_bytes) },
+        { "total_bytes", static_cast<qint64>(total_bytes()) },
+    };
+}
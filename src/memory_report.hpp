@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include <QJsonObject>
+
+#include "lua_heap.hpp"
+
+class POBWindow;
+
+// Where the process' memory goes, by consumer. GPU figures are what the
+// textures were allocated at; drivers may pad or keep copies of their own.
+struct MemoryReport
+{
+    std::vector<LuaHeap::Usage> lua_heaps;
+    size_t string_texture_bytes = 0;
+    size_t texture_vram_bytes = 0;
+    // Compressed copies kept for re-uploading evicted textures.
+    size_t texture_cpu_copy_bytes = 0;
+    size_t atlas_bytes = 0;
+    size_t loader_pending_bytes = 0;
+    size_t command_buffer_bytes = 0;
+    size_t snapshot_bytes = 0;
+
+    // GUI thread only.
+    static MemoryReport collect(const POBWindow& window);
+
+    size_t total_bytes() const;
+    QJsonObject to_json() const;
+};
@@ -0,0 +1,103 @@
+#include "module_cache.hpp"
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+
+#include "disk_cache.hpp"
+
+extern "C" {
+    #include "lua.h"
+    #include "lauxlib.h"
+}
+
+namespace {
+    // Bump if what goes into a cache entry changes.
+    constexpr int DiskCacheVersion = 1;
+    constexpr qint64 DiskCacheMaxBytes = 64 * 1024 * 1024;
+    constexpr int DiskCacheMaxAgeDays = 30;
+
+    int WriteBytecode(lua_State*, const void* data, size_t size, void* out)
+    {
+        static_cast<QByteArray*>(out)->append(static_cast<const char*>(data), static_cast<qsizetype>(size));
+        return 0;
+    }
+}
+
+void ModuleCache::set_disk_cache(const QString& dir)
+{
+    if (QDir().mkpath(dir)) {
+        _disk_cache_dir = dir;
+        PruneDiskCache(dir, ".luac", DiskCacheMaxBytes, DiskCacheMaxAgeDays);
+    }
+}
+
+int ModuleCache::load(lua_State* L, const QString& name) const
+{
+    const QString path = QDir(_script_dir).filePath(name);
+    // Same chunk name luaL_loadfile would have used, for error messages and
+    // tracebacks.
+    const QByteArray chunk_name = QByteArray("@") + name.toUtf8();
+
+    const QString cache_path = disk_cache_path(path);
+    if (!cache_path.isEmpty()) {
+        QFile file(cache_path);
+        if (file.open(QIODevice::ReadOnly)) {
+            const QByteArray bytecode = file.readAll();
+            if (luaL_loadbuffer(L, bytecode.constData(), bytecode.size(), chunk_name.constData()) == 0) {
+                TouchDiskCacheEntry(file);
+                return 0;
+            }
+            // Written by a different LuaJIT build, or damaged.
+            lua_pop(L, 1);
+            file.close();
+            file.remove();
+        }
+    }
+
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        lua_pushfstring(L, "cannot open %s", name.toUtf8().constData());
+        return LUA_ERRFILE;
+    }
+    QByteArray source = file.readAll();
+    file.close();
+    // luaL_loadfile skips a leading #! line, keeping its newline so line
+    // numbers stay right.
+    if (source.startsWith('#')) {
+        qsizetype eol = source.indexOf('\n');
+        source.remove(0, eol < 0 ? source.size() : eol);
+    }
+    int err = luaL_loadbuffer(L, source.constData(), source.size(), chunk_name.constData());
+    if (err || cache_path.isEmpty()) {
+        return err;
+    }
+
+    QByteArray bytecode;
+    if (lua_dump(L, WriteBytecode, &bytecode) == 0 && !bytecode.isEmpty()) {
+        QSaveFile cache(cache_path);
+        if (cache.open(QIODevice::WriteOnly)) {
+            cache.write(bytecode);
+            cache.commit();
+        }
+    }
+    return 0;
+}
+
+QString ModuleCache::disk_cache_path(const QString& path) const
+{
+    QFileInfo info(path);
+    if (_disk_cache_dir.isEmpty() || !info.exists()) {
+        return {};
+    }
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(info.absoluteFilePath().toUtf8());
+    hash.addData(QByteArray::number(info.lastModified().toMSecsSinceEpoch()));
+    hash.addData(QByteArray::number(info.size()));
+    hash.addData(QByteArray::number(DiskCacheVersion));
+    return _disk_cache_dir + "/" + QString::fromLatin1(hash.result().toHex()) + ".luac";
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <QString>
+
+struct lua_State;
+
+// Loads Lua modules, keeping their compiled bytecode on disk so that later
+// runs skip the parse. Cache entries are keyed by the module's path,
+// modification time and size, so editing a module simply misses the cache;
+// the entry it leaves behind is pruned once unused for long enough.
+//
+// Paths are resolved against a fixed script directory rather than the
+// process working directory, and load() touches no shared state, so any
+// Lua state may load modules from any thread.
+class ModuleCache
+{
+public:
+    void set_script_dir(const QString& dir) {
+        _script_dir = dir;
+    }
+    // Prunes the least recently used entries. Call before the first load().
+    void set_disk_cache(const QString& dir);
+
+    // Like luaL_loadfile: pushes the compiled chunk and returns 0, or pushes
+    // the error message and returns the error code. Relative names are
+    // looked up in the script directory.
+    int load(lua_State* L, const QString& name) const;
+
+private:
+    QString disk_cache_path(const QString& path) const;
+
+    QString _script_dir;
+    QString _disk_cache_dir;
+};
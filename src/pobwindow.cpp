@@ -3,12 +3,19 @@
 #include <QColor>
 #include <QDateTime>
 #include <QKeyEvent>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
 #include <QtGui/QGuiApplication>
 #include <QImageReader>
+#include <algorithm>
+#include <cmath>
 #include <memory>
 #include <stdexcept>
 
+#include "hitch_watchdog.hpp"
 #include "lua_utils.hpp"
+#include "startup_trace.hpp"
+#include "trace_recorder.hpp"
 
 extern lua_State *L;
 
@@ -36,6 +43,12 @@ void pushMouseString(QMouseEvent *event) {
     }
 }
 
+// Images loaded with different sampling flags need separate textures, ASYNC
+// only changes when they are loaded.
+QString textureKey(const QString& path, int flags) {
+    return QString::number(flags & ~TF_ASYNC) + ":" + path;
+}
+
 bool pushKeyString(int keycode) {
     switch (keycode) {
     case Qt::Key_Escape:
@@ -88,14 +101,45 @@ bool pushKeyString(int keycode) {
 
 POBWindow::~POBWindow()
 {
+    subScriptPool.stop();
     textureLoader.stop();
     textureLoader.wait();
+
+    makeCurrent();
+    textureUploader.cleanup();
+    gpuTimer.cleanup();
+    textureResidency.clear();
+    textureAtlas.clear();
+    doneCurrent();
+}
+
+void POBWindow::DetectBlockCompression()
+{
+    // OnInit loads its synchronous images before the window is shown and
+    // has a context, so ask a throwaway one with the same format.
+    QOffscreenSurface surface;
+    surface.setFormat(requestedFormat());
+    surface.create();
+    QOpenGLContext probe;
+    probe.setFormat(requestedFormat());
+    if (!surface.isValid() || !probe.create() || !probe.makeCurrent(&surface)) {
+        // Left to initializeGL, images loaded before then stay RGBA8.
+        return;
+    }
+    textureLoader.set_block_compression(
+        blockCompression && probe.hasExtension("GL_EXT_texture_compression_s3tc"));
+    probe.doneCurrent();
 }
 
 void POBWindow::initializeGL() {
     QImage wimg{1, 1, QImage::Format_Mono};
     wimg.fill(1);
     white.reset(new QOpenGLTexture(wimg));
+    textureUploader.initialize(context());
+    gpuTimer.initialize(context());
+    // Normally agrees with DetectBlockCompression().
+    textureLoader.set_block_compression(
+        blockCompression && context()->hasExtension("GL_EXT_texture_compression_s3tc"));
     glClearColor(0.0, 0.0, 0.0, 1.0);
     glEnable(GL_TEXTURE_2D);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
@@ -117,6 +161,7 @@ void POBWindow::resizeGL(int w, int h) {
 
 void POBWindow::paintGL() {
     //exit(1);
+    TraceRecorder::Scope frameTrace("frame", "paintGL");
     isDrawing = true;
     glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
     glColor4f(0, 0, 0, 0);
@@ -127,53 +172,115 @@ void POBWindow::paintGL() {
       layer.second.clear();
     }
 
-    uniqueTextureDrawn.clear();
+    frameCount++;
     dscount = 0;
+    renderStats = {};
 
     currentLayer = &layers[{0, 0}];
     curLayer = 0;
     curSubLayer = 0;
 
-    pushCallback("OnFrame");
-    int result = lua_pcall(L, 1, 0, 0);
-    if (result != 0) {
-        lua_error(L);
+    {
+        TraceRecorder::Scope trace("frame", "OnFrame");
+        HitchWatchdog::Scope watch("OnFrame");
+        pushCallback("OnFrame");
+        int result = lua_pcall(L, 1, 0, 0);
+        if (result != 0) {
+            lua_error(L);
+        }
     }
 
     if (dscount > stringCache.maxCost()) {
         stringCache.setMaxCost(static_cast<int>(1.2f * dscount));
     }
-    if (uniqueTextureDrawn.size() > textureCache.maxCost()) {
-        textureCache.setMaxCost(static_cast<int>(1.2f * uniqueTextureDrawn.size()));
-    }
 
-    if (RetrieveLoadedTextures()) {
-        repaintTimer.start(10);
+    {
+        TraceRecorder::Scope trace("frame", "RetrieveLoadedTextures");
+        if (RetrieveLoadedTextures()) {
+            repaintTimer.start(10);
+        }
+        textureResidency.evict(frameCount);
     }
 
-    for (auto& layer : layers) {
-        for (auto& cmd : layer.second) {
-            cmd->execute();
+    {
+        TraceRecorder::Scope trace("frame", "SubmitCommands");
+        gpuTimer.begin_frame(frameCount, gpuTiming || renderStatsOverlay || traceRecorder.enabled());
+        for (auto& layer : layers) {
+            if (layer.second.empty()) {
+                continue;
+            }
+            // Timed layers can't share a batch with their neighbours.
+            if (gpuTimer.timing()) {
+                FlushBatch();
+                gpuTimer.begin_layer(layer.first.first, layer.first.second);
+            }
+            for (auto& cmd : layer.second) {
+                cmd->execute();
+            }
+            if (gpuTimer.timing()) {
+                FlushBatch();
+                gpuTimer.end_layer();
+            }
         }
+        FlushBatch();
+        gpuTimer.end_frame();
+    }
+    lastRenderStats = renderStats;
+    if (renderStatsOverlay) {
+        DrawRenderStatsOverlay();
     }
     isDrawing = false;
+
+    startupTrace.frame_finished(texturesInFlight == 0);
 }
 
-void POBWindow::subScriptFinished() {
-    bool clean = true;
-    for (int i = 0;i < subScriptList.size();i++) {
-        if (subScriptList[i].get()) {
-            clean = false;
-            if (subScriptList[i]->isFinished()) {
-                subScriptList[i]->onSubFinished(L, i);
-                subScriptList[i].reset();
+void POBWindow::DrawRenderStatsOverlay() {
+    // Drawn through the regular string path once the frame's counters have
+    // been taken, so it doesn't show up in them.
+    const auto& stats = lastRenderStats;
+    QStringList lines;
+    QString commands = QString("commands %1 (").arg(stats.commandCount());
+    for (size_t i = 0; i < stats.commands.size(); i++) {
+        commands += QString(i ? " %1 %2" : "%1 %2").arg(RenderStats::CommandNames[i]).arg(stats.commands[i]);
+    }
+    lines << commands + ")";
+    lines << QString("draws %1 binds %2 colors %3 viewports %4")
+        .arg(stats.drawCalls).arg(stats.textureBinds).arg(stats.colorChanges).arg(stats.viewportChanges);
+    lines << QString("strings %1 hit %2 miss").arg(stats.stringCacheHits).arg(stats.stringCacheMisses);
+    lines << QString("textures %1 hit %2 miss %3 white").arg(stats.textureHits).arg(stats.textureMisses).arg(stats.whitePlaceholders);
+    if (gpuTimer.supported()) {
+        uint64_t gpuNsecs = 0;
+        const GpuTimer::LayerTime* slowest = nullptr;
+        for (const auto& t : gpuTimer.layer_times()) {
+            gpuNsecs += t.nsecs;
+            if (slowest == nullptr || t.nsecs > slowest->nsecs) {
+                slowest = &t;
             }
         }
+        QString gpu = QString("gpu %1 ms").arg(gpuNsecs / 1e6, 0, 'f', 2);
+        if (slowest != nullptr) {
+            gpu += QString(", slowest layer %1.%2 %3 ms").arg(slowest->layer).arg(slowest->sub_layer).arg(slowest->nsecs / 1e6, 0, 'f', 2);
+        }
+        lines << gpu;
     }
-    if (clean) {
-        subScriptList.clear();
+
+    ViewportCmd(0, 0, width, height).execute();
+    constexpr int LineHeight = 14;
+    int y = height - LineHeight * lines.size() - 4;
+    for (const auto& line : lines) {
+        DrawStringCmd cmd(4, y, F_RIGHT, LineHeight, F_FIXED, line.toUtf8().constData());
+        cmd.setCol(1.0f, 1.0f, 0.0f);
+        cmd.execute();
+        y += LineHeight;
     }
+    FlushBatch();
+}
 
+void POBWindow::subScriptFinished() {
+    HitchWatchdog::Scope watch("OnSubFinished");
+    subScriptPool.dispatchFinished([](int id, SubScript& job) {
+        job.onSubFinished(L, id);
+    });
     update();
 }
 
@@ -182,6 +289,7 @@ void POBWindow::mouseMoveEvent(QMouseEvent *event) {
 }
 
 void POBWindow::mousePressEvent(QMouseEvent *event) {
+    HitchWatchdog::Scope watch("OnKeyDown");
     pushCallback("OnKeyDown");
     pushMouseString(event);
     lua_pushboolean(L, false);
@@ -193,6 +301,7 @@ void POBWindow::mousePressEvent(QMouseEvent *event) {
 }
 
 void POBWindow::mouseReleaseEvent(QMouseEvent *event) {
+    HitchWatchdog::Scope watch("OnKeyUp");
     pushCallback("OnKeyUp");
     pushMouseString(event);
     int result = lua_pcall(L, 2, 0, 0);
@@ -203,6 +312,7 @@ void POBWindow::mouseReleaseEvent(QMouseEvent *event) {
 }
 
 void POBWindow::mouseDoubleClickEvent(QMouseEvent *event) {
+    HitchWatchdog::Scope watch("OnKeyDown");
     pushCallback("OnKeyDown");
     pushMouseString(event);
     lua_pushboolean(L, true);
@@ -214,6 +324,7 @@ void POBWindow::mouseDoubleClickEvent(QMouseEvent *event) {
 }
 
 void POBWindow::wheelEvent(QWheelEvent *event) {
+    HitchWatchdog::Scope watch("OnKeyUp");
     pushCallback("OnKeyUp");
     if (event->angleDelta().y() > 0) {
         lua_pushstring(L, "WHEELUP");
@@ -231,6 +342,7 @@ void POBWindow::wheelEvent(QWheelEvent *event) {
 }
 
 void POBWindow::keyPressEvent(QKeyEvent *event) {
+    HitchWatchdog::Scope watch("OnKeyDown");
     pushCallback("OnKeyDown");
     if (!pushKeyString(event->key())) {
         if (event->key() >= ' ' && event->key() <= '~') {
@@ -260,6 +372,7 @@ void POBWindow::keyPressEvent(QKeyEvent *event) {
 }
 
 void POBWindow::keyReleaseEvent(QKeyEvent *event) {
+    HitchWatchdog::Scope watch("OnKeyUp");
     pushCallback("OnKeyUp");
     if (!pushKeyString(event->key())) {
         lua_pushstring(L, "ASDF");
@@ -272,51 +385,85 @@ void POBWindow::keyReleaseEvent(QKeyEvent *event) {
     update();
 }
 
-LazyLoadedTexture& POBWindow::GetLazyLoadedTexture(const QString& path)
+LazyLoadedTexture& POBWindow::GetLazyLoadedTexture(const QString& path, int flags)
 {
-    auto iter = textureIndexByPath.find(path);
+    QString key = textureKey(path, flags);
+    auto iter = textureIndexByPath.find(key);
     if (iter != textureIndexByPath.end()) {
-        return lazyLoadedTexture[iter->GetIndex()];
+        return lazyLoadedTexture[*iter];
     }
 
+    StartupTrace::Scope trace(startupTrace, StartupTrace::Kind::ImageProbe, path);
     QImageReader reader(path);
     QSize size = reader.size();
     if (not size.isValid() || size.isEmpty()) {
         // invalid image
         return lazyLoadedTexture[0];
     }
-    TextureIndex new_tex_idx = lazyLoadedTexture.size();
-    lazyLoadedTexture.append({
-            .index = new_tex_idx,
-            .path = path,
-            .size = size,
-            .state = LoadState::NotLoaded,
-            });
-    textureIndexByPath[path] = new_tex_idx;
-    return lazyLoadedTexture[new_tex_idx.GetIndex()];
+    TextureIndex new_tex_idx = lazyLoadedTexture.add(path, size, flags);
+    textureIndexByPath[key] = new_tex_idx;
+    auto& llt = lazyLoadedTexture[new_tex_idx];
+    if (!(flags & TF_ASYNC)) {
+        // Synchronous images are decoded right here, which needs no GL
+        // context, and uploaded in full by the next paintGL so they are
+        // never drawn white.
+        llt.state = LoadState::Loading;
+        texturesInFlight++;
+        syncLoadedTextures.emplace_back(new_tex_idx, textureLoader.load_now(llt, TextureLoadSize(llt)));
+    }
+    return llt;
 }
 
 LazyLoadedTexture& POBWindow::GetLazyLoadedTexture(TextureIndex index)
 {
-    if (index.GetIndex() >= static_cast<size_t>(lazyLoadedTexture.size())) {
-        return lazyLoadedTexture[0];
-    }
-    return lazyLoadedTexture[index.GetIndex()];
+    return lazyLoadedTexture[index];
+}
+
+void POBWindow::RequestTexture(TextureIndex index)
+{
+    TextureRegion region;
+    GetTexture(index, region, false);
 }
 
-QOpenGLTexture& POBWindow::GetTexture(TextureIndex index)
+QOpenGLTexture& POBWindow::GetTexture(TextureIndex index, TextureRegion& region, bool count)
 {
-    uniqueTextureDrawn.insert(index.GetIndex());
+    // Resolve through the table first, the residency manager is keyed by slot
+    // and a stale handle must not pick up whatever reuses its slot.
+    auto* llt = lazyLoadedTexture.find(index);
+    if (llt == nullptr || !index.IsValid()) {
+        return *white;
+    }
+    if (llt->alias.IsValid()) {
+        return GetTexture(llt->alias, region, count);
+    }
 
-    auto* tex = textureCache[index.GetIndex()];
+    auto* tex = textureResidency.get(index, frameCount);
     if (tex != nullptr) {
+        if (count) {
+            renderStats.textureHits++;
+        }
+        if (llt->state == LoadState::Loaded && llt->loaded_size.width() < llt->size.width()
+                && TextureLoadSize(*llt).width() > llt->loaded_size.width()) {
+            // Drawn larger than the downscaled copy allows, keep drawing it
+            // until a sharper one has been uploaded.
+            RequestTextureLoad(*llt, false);
+        }
+        return *tex;
+    }
+    tex = textureAtlas.find(index, region);
+    if (tex != nullptr) {
+        if (count) {
+            renderStats.textureHits++;
+        }
         return *tex;
     }
 
-    auto& llt = lazyLoadedTexture[index.GetIndex()];
-    if (llt.state == LoadState::NotLoaded || llt.state == LoadState::Loaded) {
-        llt.state = LoadState::Loading;
-        textureLoader.request_load(llt);
+    if (count) {
+        renderStats.textureMisses++;
+    }
+
+    if (llt->state == LoadState::NotLoaded || llt->state == LoadState::Loaded) {
+        RequestTextureLoad(*llt);
     }
 
     if (white == nullptr) {
@@ -325,26 +472,241 @@ QOpenGLTexture& POBWindow::GetTexture(TextureIndex index)
     return *white;
 }
 
+void POBWindow::NoteDrawSize(TextureIndex index, float w, float h)
+{
+    auto* llt = lazyLoadedTexture.find(index);
+    if (llt == nullptr || !index.IsValid() || !std::isfinite(w) || !std::isfinite(h)) {
+        return;
+    }
+    if (llt->alias.IsValid()) {
+        llt = lazyLoadedTexture.find(llt->alias);
+    }
+    const float ratio = devicePixelRatio();
+    const int dw = std::min(static_cast<int>(std::ceil(std::abs(w) * ratio)), llt->size.width());
+    const int dh = std::min(static_cast<int>(std::ceil(std::abs(h) * ratio)), llt->size.height());
+    llt->draw_size = llt->draw_size.expandedTo(QSize(dw, dh));
+}
+
+QSize POBWindow::TextureLoadSize(const LazyLoadedTexture& llt) const
+{
+    // Not drawn yet (eagerly loaded synchronous images): full size.
+    if (llt.draw_size.isEmpty()) {
+        return llt.size;
+    }
+    // Halve in whole steps so a slowly growing draw size only causes a
+    // handful of reloads.
+    const QSize fit = llt.draw_size.expandedTo(QSize(MinDownscaleSize, MinDownscaleSize));
+    QSize size = llt.size;
+    while (size.width() / 2 >= fit.width() && size.height() / 2 >= fit.height()) {
+        size = QSize(size.width() / 2, size.height() / 2);
+    }
+    return size;
+}
+
+void POBWindow::RequestTextureLoad(LazyLoadedTexture& llt, bool from_copy)
+{
+    // Evicted textures come back from their compressed copy if we still
+    // have one, otherwise from disk.
+    llt.state = LoadState::Loading;
+    texturesInFlight++;
+    auto copy = from_copy ? textureResidency.find_copy(llt.index) : nullptr;
+    textureLoader.request_load(llt, std::move(copy), TextureLoadSize(llt));
+}
+
+void POBWindow::ExcludeFromAtlas(TextureIndex index)
+{
+    auto* llt = lazyLoadedTexture.find(index);
+    if (llt != nullptr && llt->alias.IsValid()) {
+        index = llt->alias;
+        llt = lazyLoadedTexture.find(index);
+    }
+    if (llt == nullptr || !index.IsValid() || llt->no_atlas) {
+        return;
+    }
+    llt->no_atlas = true;
+    if (textureAtlas.remove(index)) {
+        // Reloaded as a texture of its own on the next draw.
+        llt->state = LoadState::NotLoaded;
+    }
+}
+
 bool POBWindow::RetrieveLoadedTextures()
 {
-   textureLoader.collect_loaded_textures(tmpLoadedTextures); 
-   if (tmpLoadedTextures.empty()) {
-       return false;
-   }
-
-   for (auto& [idx, img] : tmpLoadedTextures) {
-       LoadState ls = LoadState::LoadFailed;
-       if (img) {
-           auto tex = std::make_unique<QOpenGLTexture>(*img);
-           if (tex->isCreated()) {
-               ls = LoadState::Loaded;
-               textureCache.insert(idx.GetIndex(), tex.release());
-           }
-       }
-       lazyLoadedTexture[idx.GetIndex()].state = ls;
-   }
-   tmpLoadedTextures.clear();
-   return true;
+    textureLoader.collect_loaded_textures(tmpLoadedTextures);
+    for (auto& loaded : syncLoadedTextures) {
+        tmpLoadedTextures.push_back(std::move(loaded));
+    }
+    syncLoadedTextures.clear();
+    for (auto& [idx, img] : tmpLoadedTextures) {
+        auto* llt = lazyLoadedTexture.find(idx);
+        if (img && llt != nullptr && llt->handles > 0 && ShareLoadedTexture(*llt, *img)) {
+            texturesInFlight--;
+            continue;
+        }
+        if (img && llt != nullptr && llt->handles > 0 && !llt->no_atlas && !img->compressed()
+                && TextureAtlas::eligible(img->image(0), static_cast<int>(img->levels.size()), llt->flags)) {
+            // Small images are copied into an atlas page by the GUI thread,
+            // synchronous ones right away and the rest within the frame's
+            // upload budget.
+            if (llt->flags & TF_ASYNC) {
+                atlasQueue.emplace_back(idx, std::move(img));
+            } else {
+                CopyToAtlas(idx, std::move(img));
+            }
+            continue;
+        }
+        if (img && llt != nullptr) {
+            textureUploader.enqueue(idx, std::move(img), llt->flags);
+            continue;
+        }
+        texturesInFlight--;
+        if (llt != nullptr) {
+            llt->state = LoadState::LoadFailed;
+            if (llt->handles == 0) {
+                UnregisterTexture(*llt);
+            }
+        }
+    }
+    tmpLoadedTextures.clear();
+
+    textureUploader.begin_frame();
+    while (!atlasQueue.empty() && textureUploader.budget_left()) {
+        auto [idx, img] = std::move(atlasQueue.front());
+        atlasQueue.pop_front();
+        textureUploader.charge(img->byte_size());
+        CopyToAtlas(idx, std::move(img));
+    }
+
+    if (!textureUploader.has_pending()) {
+        return !atlasQueue.empty();
+    }
+
+    // Textures whose upload fence has signalled, or with the in-frame
+    // fallback whatever fit in this frame's budget. The rest is picked up
+    // again by the next paintGL.
+    textureUploader.process(tmpUploadedTextures);
+    for (auto& up : tmpUploadedTextures) {
+        texturesInFlight--;
+        auto* llt = lazyLoadedTexture.find(up.index);
+        if (llt == nullptr) {
+            continue;
+        }
+        if (llt->handles == 0) {
+            // Every handle was collected while the image was in flight.
+            UnregisterTexture(*llt);
+            continue;
+        }
+        LoadState ls = LoadState::LoadFailed;
+        if (up.texture && up.texture->isCreated()) {
+            ls = LoadState::Loaded;
+            textureResidency.insert(up.index, std::move(up.texture), up.bytes, frameCount);
+            llt->loaded_size = up.size;
+            textureResidency.store_copy(up.index, std::move(up.packed), frameCount);
+        }
+        llt->state = ls;
+    }
+    tmpUploadedTextures.clear();
+    return true;
+}
+
+void POBWindow::CopyToAtlas(TextureIndex idx, std::unique_ptr<DecodedTexture> img)
+{
+    auto* llt = lazyLoadedTexture.find(idx);
+    if (llt == nullptr || llt->handles == 0) {
+        // Every handle was collected while the image was queued.
+        texturesInFlight--;
+        if (llt != nullptr) {
+            UnregisterTexture(*llt);
+        }
+        return;
+    }
+    if (!llt->no_atlas && textureAtlas.insert(idx, img->image(0))) {
+        texturesInFlight--;
+        llt->state = LoadState::Loaded;
+        llt->loaded_size = QSize(img->width(), img->height());
+        return;
+    }
+    // Excluded meanwhile, or no page has room.
+    textureUploader.enqueue(idx, std::move(img), llt->flags);
+}
+
+bool POBWindow::ShareLoadedTexture(LazyLoadedTexture& llt, const DecodedTexture& img)
+{
+    if (img.content_hash.isEmpty()) {
+        return false;
+    }
+    // Wrap and filter modes are part of the texture, only images loaded
+    // with the same flags can share one.
+    QByteArray key = QByteArray::number(llt.flags & ~TF_ASYNC) + ':' + img.content_hash;
+    if (!llt.content_key.isEmpty()) {
+        // Reloaded after eviction or at another size. Others may alias this
+        // image already, so it stays an owner whatever its new pixels are.
+        if (key != llt.content_key) {
+            auto iter = textureIndexByContent.find(llt.content_key);
+            if (iter != textureIndexByContent.end() && *iter == llt.index) {
+                textureIndexByContent.erase(iter);
+            }
+            if (!textureIndexByContent.contains(key)) {
+                textureIndexByContent.insert(key, llt.index);
+            }
+            llt.content_key = key;
+        }
+        return false;
+    }
+
+    auto iter = textureIndexByContent.find(key);
+    auto* owner = iter != textureIndexByContent.end() ? lazyLoadedTexture.find(*iter) : nullptr;
+    if (owner == nullptr || owner->handles == 0) {
+        textureIndexByContent.insert(key, llt.index);
+        llt.content_key = key;
+        return false;
+    }
+
+    llt.alias = owner->index;
+    RetainTexture(owner->index);
+    llt.state = LoadState::Loaded;
+    llt.loaded_size = owner->loaded_size;
+    textureDedupHits++;
+    return true;
+}
+
+void POBWindow::RetainTexture(TextureIndex index)
+{
+    if (auto* llt = lazyLoadedTexture.find(index); llt && index.IsValid()) {
+        llt->handles++;
+    }
+}
+
+void POBWindow::ReleaseTexture(TextureIndex index)
+{
+    auto* llt = lazyLoadedTexture.find(index);
+    if (llt == nullptr || !index.IsValid() || --llt->handles > 0) {
+        return;
+    }
+    // The loader may still be reading the slot, RetrieveLoadedTextures
+    // unregisters it once the load comes back.
+    if (llt->state != LoadState::Loading) {
+        UnregisterTexture(*llt);
+    }
+}
+
+void POBWindow::UnregisterTexture(LazyLoadedTexture& llt)
+{
+    TextureIndex index = llt.index;
+    TextureIndex alias = llt.alias;
+    textureIndexByPath.remove(textureKey(llt.path, llt.flags));
+    if (!llt.content_key.isEmpty()) {
+        auto iter = textureIndexByContent.find(llt.content_key);
+        if (iter != textureIndexByContent.end() && *iter == index) {
+            textureIndexByContent.erase(iter);
+        }
+    }
+    textureResidency.release(index);
+    textureAtlas.remove(index);
+    lazyLoadedTexture.remove(index);
+    if (alias.IsValid()) {
+        ReleaseTexture(alias);
+    }
 }
 
 
@@ -376,9 +738,57 @@ void POBWindow::SetDrawLayer(int layer, int subLayer) {
 
 
 void POBWindow::AppendCmd(std::unique_ptr<Cmd> cmd) {
+    renderStats[cmd->kind()]++;
     currentLayer->emplace_back(std::move(cmd));
 }
 
+size_t POBWindow::CommandBufferBytes() const {
+    size_t bytes = 0;
+    for (const auto& layer : layers) {
+        bytes += layer.second.capacity() * sizeof(std::unique_ptr<Cmd>);
+        for (const auto& cmd : layer.second) {
+            switch (cmd->kind()) {
+            case RenderStats::Command::Viewport:
+                bytes += sizeof(ViewportCmd);
+                break;
+            case RenderStats::Command::Color:
+                bytes += sizeof(ColorCmd);
+                break;
+            case RenderStats::Command::Image:
+                bytes += sizeof(DrawImageCmd);
+                break;
+            case RenderStats::Command::ImageQuad:
+                bytes += sizeof(DrawImageQuadCmd);
+                break;
+            case RenderStats::Command::String:
+            case RenderStats::Command::Count:
+                bytes += sizeof(DrawStringCmd);
+                break;
+            }
+        }
+    }
+    return bytes;
+}
+
+void POBWindow::BatchTexture(QOpenGLTexture& tex) {
+    if (batchTexture == tex.textureId()) {
+        return;
+    }
+    FlushBatch();
+    tex.bind();
+    glBegin(GL_QUADS);
+    batchTexture = tex.textureId();
+    renderStats.textureBinds++;
+    renderStats.drawCalls++;
+}
+
+void POBWindow::FlushBatch() {
+    if (batchTexture != 0) {
+        glEnd();
+        batchTexture = 0;
+    }
+}
+
 void POBWindow::DrawColor(const float col[4]) {
     if (col) {
         drawColor[0] = col[0];
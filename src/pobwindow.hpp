@@ -1,3 +1,4 @@
+#include <deque>
 #include <memory>
 
 #include <QCache>
@@ -5,19 +6,34 @@
 #include <QHash>
 #include <QOpenGLWindow>
 #include <QPainter>
-#include <QSet>
 #include <QStandardPaths>
 #include <QTimer>
 
 #include "main.h"
 #include "src/texture_loader.hpp"
+#include "texture_atlas.hpp"
+#include "texture_residency.hpp"
+#include "texture_table.hpp"
+#include "texture_uploader.hpp"
 #include "subscript.hpp"
+#include "subscript_pool.hpp"
+#include "gpu_timer.hpp"
 #include "lazy_loaded_texture.hpp"
+#include "module_cache.hpp"
 
 class POBWindow : public QOpenGLWindow {
     Q_OBJECT
 public:
-    POBWindow() : stringCache(200), textureCache(12) {
+    static constexpr size_t VramBudget = 768 * 1024 * 1024;
+    static constexpr size_t CpuCopyBudget = 256 * 1024 * 1024;
+    // Images are never downscaled below this on either side.
+    static constexpr int MinDownscaleSize = 256;
+
+    POBWindow()
+        : textureLoader(lazyLoadedTexture)
+        , subScriptPool([this] { QMetaObject::invokeMethod(this, &POBWindow::subScriptFinished, Qt::QueuedConnection); })
+        , stringCache(200)
+        , textureResidency(VramBudget, CpuCopyBudget) {
         QString AppDataLocation = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
         scriptPath = QDir::currentPath() + "/src";
         scriptWorkDir = QDir::currentPath() + "/src";
@@ -25,24 +41,25 @@ public:
         userPath = AppDataLocation;
 
         fontFudge = -2;
+        blockCompression = true;
 
         connect(&repaintTimer, &QTimer::timeout, this, QOverload<>::of(&QOpenGLWindow::update));
 
         currentLayer = &layers[{0, 0}];
 
         textureIndexByPath.reserve(200);
-        lazyLoadedTexture.append({
-            .index = 0,
-            .path = "<none>",
-            .size = { 1, 1 },
-            .state = LoadState::Loaded,
-            });
 
+        textureLoader.set_disk_cache(userPath + "/texture-cache");
+        moduleCache.set_script_dir(scriptPath);
+        moduleCache.set_disk_cache(userPath + "/module-cache");
         textureLoader.start();
     }
 
     ~POBWindow();
 
+    // Decides whether large images are block compressed, before the first
+    // one loads. Call once blockCompression is final.
+    void DetectBlockCompression();
     void initializeGL();
     void resizeGL(int w, int h);
     void paintGL();
@@ -56,10 +73,30 @@ public:
     void keyPressEvent(QKeyEvent *event);
     void keyReleaseEvent(QKeyEvent *event);
 
-    LazyLoadedTexture& GetLazyLoadedTexture(const QString& path);
+    LazyLoadedTexture& GetLazyLoadedTexture(const QString& path, int flags);
     LazyLoadedTexture& GetLazyLoadedTexture(TextureIndex index);
-    QOpenGLTexture& GetTexture(TextureIndex index);
+    // Starts loading the image if it isn't on the GPU yet. For recording
+    // draws; lookups count towards renderStats only when submitted.
+    void RequestTexture(TextureIndex index);
+    QOpenGLTexture& GetTexture(TextureIndex index, TextureRegion& region, bool count = true);
+    void ExcludeFromAtlas(TextureIndex index);
+    // Records that the whole image would cover w x h logical pixels.
+    void NoteDrawSize(TextureIndex index, float w, float h);
+    QSize TextureLoadSize(const LazyLoadedTexture& llt) const;
+    void RequestTextureLoad(LazyLoadedTexture& llt, bool from_copy = true);
     bool RetrieveLoadedTextures();
+    void CopyToAtlas(TextureIndex idx, std::unique_ptr<DecodedTexture> img);
+    // Returns true if `llt` became an alias of an image with the same pixels.
+    bool ShareLoadedTexture(LazyLoadedTexture& llt, const DecodedTexture& img);
+    void RetainTexture(TextureIndex index);
+    void ReleaseTexture(TextureIndex index);
+    void UnregisterTexture(LazyLoadedTexture& llt);
+    int GetTexAsyncCount() const {
+        return texturesInFlight;
+    }
+    int GetTexDedupHits() const {
+        return textureDedupHits;
+    }
 
     int IsUserData(lua_State* L, int index, const char* metaName);
 
@@ -69,8 +106,13 @@ public:
         SetDrawLayer(curLayer, subLayer);
     }
     void AppendCmd(std::unique_ptr<Cmd> cmd);
+    void BatchTexture(QOpenGLTexture& tex);
+    void FlushBatch();
     void DrawColor(const float col[4] = NULL);
     void DrawColor(uint32_t col);
+    void DrawRenderStatsOverlay();
+    // Capacity of the layers' command lists plus the commands in them.
+    size_t CommandBufferBytes() const;
 
     QString scriptPath;
     QString scriptWorkDir;
@@ -79,24 +121,46 @@ public:
     int curLayer;
     int curSubLayer;
     int fontFudge;
+    // Software S3TC for large images, if the driver supports it.
+    bool blockCompression;
     int width;
     int height;
     bool isDrawing;
     QString fontName;
     float drawColor[4];
 
+    // Declared before textureLoader, which keeps a reference to it.
+    TextureTable lazyLoadedTexture;
     TextureLoader textureLoader;
-    QList<std::shared_ptr<SubScript>> subScriptList;
+    TextureUploader textureUploader;
+    int texturesInFlight = 0;
+    int textureDedupHits = 0;
+    uint64_t frameCount = 0;
+    // The frame being recorded and the last one submitted.
+    RenderStats renderStats;
+    RenderStats lastRenderStats;
+    bool renderStatsOverlay = false;
+    // Layers are also timed while tracing or with the overlay up.
+    bool gpuTiming = false;
+    GpuTimer gpuTimer;
+    SubScriptPool subScriptPool;
+    ModuleCache moduleCache;
 
     std::map<QPair<int, int>, std::vector<std::unique_ptr<Cmd>>> layers;
     std::vector<std::unique_ptr<Cmd>>* currentLayer = nullptr;
-    std::vector<std::pair<TextureIndex, std::unique_ptr<QImage>>> tmpLoadedTextures;
+    // Images loaded without TF_ASYNC, decoded but not handed on yet.
+    std::vector<std::pair<TextureIndex, std::unique_ptr<DecodedTexture>>> syncLoadedTextures;
+    std::vector<std::pair<TextureIndex, std::unique_ptr<DecodedTexture>>> tmpLoadedTextures;
+    std::vector<UploadedTexture> tmpUploadedTextures;
+    // Small images waiting for room in a frame's upload budget.
+    std::deque<std::pair<TextureIndex, std::unique_ptr<DecodedTexture>>> atlasQueue;
     std::unique_ptr<QOpenGLTexture> white;
     QHash<QString, TextureIndex> textureIndexByPath;
-    QSet<size_t> uniqueTextureDrawn;
-    QList<LazyLoadedTexture> lazyLoadedTexture;
+    QHash<QByteArray, TextureIndex> textureIndexByContent;
     QCache<QString, std::shared_ptr<QOpenGLTexture>> stringCache;
-    QCache<size_t, QOpenGLTexture> textureCache;
+    TextureResidency textureResidency;
+    TextureAtlas textureAtlas;
+    GLuint batchTexture = 0;
     QTimer repaintTimer;
 };
 
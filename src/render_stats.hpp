@@ -0,0 +1,51 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Per-frame renderer counters. POBWindow resets them when a frame starts and
+// keeps the finished frame's for GetRenderStats and the overlay.
+struct RenderStats
+{
+    enum class Command
+    {
+        Viewport,
+        Color,
+        Image,
+        ImageQuad,
+        String,
+        Count
+    };
+
+    static constexpr std::array<const char*, static_cast<size_t>(Command::Count)> CommandNames = {
+        "viewport", "color", "image", "imageQuad", "string",
+    };
+
+    std::array<uint32_t, static_cast<size_t>(Command::Count)> commands = {};
+    // glBegin/glEnd pairs.
+    uint32_t drawCalls = 0;
+    uint32_t textureBinds = 0;
+    uint32_t colorChanges = 0;
+    uint32_t viewportChanges = 0;
+    uint32_t stringCacheHits = 0;
+    uint32_t stringCacheMisses = 0;
+    // Image lookups by submitted draws. A miss is one still waiting on the
+    // loader.
+    uint32_t textureHits = 0;
+    uint32_t textureMisses = 0;
+    // Image quads submitted with `white` standing in for their texture.
+    uint32_t whitePlaceholders = 0;
+
+    uint32_t& operator[](Command command) {
+        return commands[static_cast<size_t>(command)];
+    }
+
+    uint32_t commandCount() const {
+        uint32_t total = 0;
+        for (auto count : commands) {
+            total += count;
+        }
+        return total;
+    }
+};
@@ -0,0 +1,154 @@
+#include "startup_trace.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+
+StartupTrace startupTrace;
+
+namespace {
+    // Bump whenever the report layout changes.
+    constexpr int ReportVersion = 1;
+
+    double ToMsecs(int64_t nsecs)
+    {
+        return nsecs / 1e6;
+    }
+
+    double CpuMsecs(std::clock_t from, std::clock_t to)
+    {
+        return 1000.0 * static_cast<double>(to - from) / CLOCKS_PER_SEC;
+    }
+
+    const char* KindName(StartupTrace::Kind kind)
+    {
+        switch (kind) {
+        case StartupTrace::Kind::Phase:
+            return "phase";
+        case StartupTrace::Kind::Module:
+            return "module";
+        case StartupTrace::Kind::ImageProbe:
+            return "image_probe";
+        }
+        return "";
+    }
+}
+
+StartupTrace::Scope::Scope(StartupTrace& trace, Kind kind, const QString& name)
+    : _trace(trace)
+{
+    if (_trace.active()) {
+        _entry = _trace.open(kind, name);
+    }
+}
+
+StartupTrace::Scope::~Scope()
+{
+    if (_entry >= 0 && _trace.active()) {
+        _trace.close(_entry);
+    }
+}
+
+void StartupTrace::start()
+{
+    _thread = std::this_thread::get_id();
+    _timer.start();
+    _active = true;
+    _entries.reserve(256);
+}
+
+void StartupTrace::phase(const char* name)
+{
+    if (!active()) {
+        return;
+    }
+    if (_phase >= 0) {
+        close(_phase);
+    }
+    _phase = open(Kind::Phase, name);
+}
+
+void StartupTrace::frame_finished(bool fully_textured)
+{
+    if (!active()) {
+        return;
+    }
+    _frames++;
+    if (_first_frame_nsecs < 0) {
+        _first_frame_nsecs = _timer.nsecsElapsed();
+    }
+    if (!fully_textured) {
+        return;
+    }
+    _textured_frame_nsecs = _timer.nsecsElapsed();
+    if (_phase >= 0) {
+        close(_phase);
+        _phase = -1;
+    }
+    write_report();
+    _active = false;
+    _entries.clear();
+    _entries.shrink_to_fit();
+}
+
+int StartupTrace::open(Kind kind, const QString& name)
+{
+    int entry = static_cast<int>(_entries.size());
+    _entries.push_back({
+        .kind = kind,
+        .name = name,
+        .depth = static_cast<int>(_open.size()),
+        .start_nsecs = _timer.nsecsElapsed(),
+        .start_cpu = std::clock(),
+    });
+    _open.push_back(entry);
+    return entry;
+}
+
+void StartupTrace::close(int entry)
+{
+    auto& e = _entries[entry];
+    e.wall_nsecs = _timer.nsecsElapsed() - e.start_nsecs;
+    e.cpu_msecs = CpuMsecs(e.start_cpu, std::clock());
+    _open.erase(std::remove(_open.begin(), _open.end(), entry), _open.end());
+}
+
+void StartupTrace::write_report() const
+{
+    QJsonArray entries;
+    for (const auto& e : _entries) {
+        if (e.wall_nsecs < 0) {
+            continue;
+        }
+        entries.append(QJsonObject{
+            { "kind", KindName(e.kind) },
+            { "name", e.name },
+            { "depth", e.depth },
+            { "start_ms", ToMsecs(e.start_nsecs) },
+            { "wall_ms", ToMsecs(e.wall_nsecs) },
+            { "cpu_ms", e.cpu_msecs },
+        });
+    }
+    QJsonObject report{
+        { "version", ReportVersion },
+        { "first_frame_ms", ToMsecs(_first_frame_nsecs) },
+        { "first_textured_frame_ms", ToMsecs(_textured_frame_nsecs) },
+        { "frames_until_textured", _frames },
+        { "cpu_ms", CpuMsecs(0, std::clock()) },
+        { "entries", entries },
+    };
+
+    std::cout << "Startup: first fully textured frame after " << ToMsecs(_textured_frame_nsecs) << " ms" << std::endl;
+    if (_report_path.isEmpty()) {
+        return;
+    }
+    QSaveFile file(_report_path);
+    if (file.open(QIODevice::WriteOnly)) {
+        file.write(QJsonDocument(report).toJson());
+        file.commit();
+    }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <thread>
+#include <vector>
+
+#include <QElapsedTimer>
+#include <QString>
+
+// Wall and CPU time of everything between process start and the first frame
+// drawn with every texture it uses in place. main() steps through its
+// phases with phase(), LoadModule and synchronous image probes open a
+// Scope each, which nest inside whatever phase or scope is open.
+//
+// Once that frame is done the report is written as JSON and recording
+// stops for good. CPU time is the process total, so loader threads working
+// meanwhile count towards the phase they overlap. Only the GUI thread
+// records.
+class StartupTrace
+{
+public:
+    enum class Kind
+    {
+        Phase,
+        Module,
+        ImageProbe,
+    };
+
+    class Scope
+    {
+    public:
+        Scope(StartupTrace& trace, Kind kind, const QString& name);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        StartupTrace& _trace;
+        int _entry = -1;
+    };
+
+    // First thing in main().
+    void start();
+    void set_report_path(const QString& path) {
+        _report_path = path;
+    }
+
+    // Ends the current phase, if any, and starts the next.
+    void phase(const char* name);
+    // Called after every frame until the report is written.
+    void frame_finished(bool fully_textured);
+
+    // Safe from any thread: _thread is set before other threads start, and
+    // _active is only read on the GUI thread, which alone writes it.
+    bool active() const {
+        return std::this_thread::get_id() == _thread && _active;
+    }
+
+private:
+    struct Entry
+    {
+        Kind kind;
+        QString name;
+        int depth;
+        int64_t start_nsecs;
+        int64_t wall_nsecs = -1;
+        std::clock_t start_cpu;
+        double cpu_msecs = 0.0;
+    };
+
+    int open(Kind kind, const QString& name);
+    void close(int entry);
+    void write_report() const;
+
+    bool _active = false;
+    std::thread::id _thread;
+    QElapsedTimer _timer;
+    QString _report_path;
+    std::vector<Entry> _entries;
+    std::vector<int> _open;
+    int _phase = -1;
+    int _frames = 0;
+    int64_t _first_frame_nsecs = -1;
+    int64_t _textured_frame_nsecs = -1;
+};
+
+extern StartupTrace startupTrace;
@@ -0,0 +1,168 @@
+#include "subscript.hpp"
+
+#include <iostream>
+
+namespace {
+    QByteArray ScriptText(lua_State *L_main)
+    {
+        size_t len = 0;
+        const char* text = lua_tolstring(L_main, 1, &len);
+        return QByteArray(text, static_cast<qsizetype>(len));
+    }
+}
+
+SubScript::SubScript(lua_State *L_main)
+    : _mainState(L_main)
+    , _script(ScriptText(L_main))
+    , _args(1)
+    , _results(1)
+    , _workers(1)
+    , _failed(1)
+    , _resultsOk(1, true)
+    , _remaining(1)
+{
+    if (!_args[0].pack(L_main, 4, lua_gettop(L_main))) {
+        _argsError = _args[0].error();
+        _badArg = _args[0].errorIndex();
+    }
+}
+
+SubScript::SubScript(lua_State *L_main, int argSets, bool ordered)
+    : _mainState(L_main)
+    , _script(ScriptText(L_main))
+    , _isMap(true)
+    , _ordered(ordered)
+{
+    int count = static_cast<int>(lua_objlen(L_main, argSets));
+    _args.resize(count);
+    _results.resize(count);
+    _workers.resize(count);
+    _failed.resize(count);
+    _resultsOk.resize(count, true);
+    _completed.reserve(count);
+    _remaining = count;
+    if (count == 0) {
+        _finished.store(true, std::memory_order_release);
+    }
+    for (int i = 0; i < count; i++) {
+        lua_rawgeti(L_main, argSets, i + 1);
+        int set = lua_gettop(L_main);
+        if (!lua_istable(L_main, set)) {
+            _argsError = std::string("expected table, got ") + lua_typename(L_main, lua_type(L_main, set));
+        } else {
+            int n = static_cast<int>(lua_objlen(L_main, set));
+            if (!lua_checkstack(L_main, n)) {
+                _argsError = "too many arguments";
+            } else {
+                for (int j = 1; j <= n; j++) {
+                    lua_rawgeti(L_main, set, j);
+                }
+                if (!_args[i].pack(L_main, set + 1, set + n)) {
+                    _argsError = "argument " + std::to_string(_args[i].errorIndex() - set) + ": " + _args[i].error();
+                }
+            }
+        }
+        lua_settop(L_main, set - 1);
+        if (!_argsError.empty()) {
+            _badArg = i + 1;
+            break;
+        }
+    }
+}
+
+void SubScript::run(lua_State *L, int item)
+{
+    if (!lua_isfunction(L, -1)) {
+        // The script didn't compile, pass the message on as the result.
+        _failed[item] = true;
+        _resultsOk[item] = _results[item].pack(L, -1, -1);
+        lua_pop(L, 1);
+        return;
+    }
+    int base = lua_gettop(L) - 1;
+    int nargs = _args[item].unpack(L);
+    if (lua_pcall(L, nargs, LUA_MULTRET, 0)) {
+        std::cout << "Error in thread call: " << lua_tostring(L, -1) << std::endl;
+        _failed[item] = true;
+    }
+    // On error the message is handed over like a result, as it always was.
+    _resultsOk[item] = _results[item].pack(L, base + 1, lua_gettop(L));
+    lua_settop(L, base);
+}
+
+bool SubScript::finishItem(int item, SubScriptWorker* worker)
+{
+    _workers[item] = worker;
+    _completed.push_back(item);
+    if (--_remaining > 0) {
+        return false;
+    }
+    _finished.store(true, std::memory_order_release);
+    return true;
+}
+
+void SubScript::releaseArgs()
+{
+    for (auto& args : _args) {
+        args.releasePins(_mainState);
+    }
+}
+
+void SubScript::onSubFinished(lua_State *L_main, int id)
+{
+    if (!_isMap && !_resultsOk[0]) {
+        std::cout << "Subscript return " << _results[0].count() << ": " << _results[0].error() << std::endl;
+        return;
+    }
+    lua_getfield(L_main, LUA_REGISTRYINDEX, "uicallbacks");
+    lua_getfield(L_main, -1, "MainObject");
+    lua_remove(L_main, -2);
+    lua_getfield(L_main, -1, "OnSubFinished");
+    lua_insert(L_main, -2);
+    lua_pushinteger(L_main, id);
+    int nargs = 1;
+    if (_isMap) {
+        // One table for all the items, in argument set order or in the
+        // order they finished.
+        lua_createtable(L_main, itemCount(), 0);
+        for (int i = 0; i < itemCount(); i++) {
+            pushItemResults(L_main, _ordered ? i : _completed[i]);
+            lua_rawseti(L_main, -2, i + 1);
+        }
+        nargs++;
+    } else {
+        nargs += _results[0].unpack(L_main);
+    }
+    int result = lua_pcall(L_main, nargs + 1, 0, 0);
+    if (result) {
+        std::cout << "Error calling OnSubFinished: " << result << std::endl;
+        std::cout << lua_tostring(L_main, -1) << std::endl;
+        lua_pop(L_main, 1);
+    }
+}
+
+void SubScript::pushItemResults(lua_State *L_main, int item)
+{
+    // { index = set number, n = result count, results... } or
+    // { index = set number, error = message }
+    lua_newtable(L_main);
+    int t = lua_gettop(L_main);
+    lua_pushinteger(L_main, item + 1);
+    lua_setfield(L_main, t, "index");
+    if (!_resultsOk[item]) {
+        lua_pushfstring(L_main, "return %d: %s", _results[item].count(), _results[item].error().c_str());
+        lua_setfield(L_main, t, "error");
+        return;
+    }
+    int n = _results[item].unpack(L_main);
+    if (_failed[item]) {
+        lua_settop(L_main, t + 1);
+        lua_setfield(L_main, t, "error");
+        return;
+    }
+    for (int i = n; i >= 1; i--) {
+        lua_rawseti(L_main, t, i);
+    }
+    lua_pushinteger(L_main, n);
+    lua_setfield(L_main, t, "n");
+}
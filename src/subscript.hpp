@@ -1,9 +1,14 @@
 #ifndef SUBSCRIPT_HPP
 #define SUBSCRIPT_HPP
 
-#include <QThread>
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
 
-#include <iostream>
+#include <QByteArray>
+
+#include "lua_marshal.hpp"
 
 extern "C" {
     #include "lua.h"
@@ -11,86 +16,107 @@ extern "C" {
     #include "lauxlib.h"
 }
 
+class SubScriptWorker;
+
 void RegisterGeneralLuaCallbacks(lua_State* L);
 
-class SubScript : public QThread {
-    Q_OBJECT
+// One LaunchSubScript or LaunchSubScriptMap call: the script text and its
+// arguments, and once pool workers have run it, its results.
+//
+// A plain subscript is a single item. A map has one item per argument set,
+// each run on whichever worker is free, and is finished once all of them
+// are.
+class SubScript {
 public:
-    SubScript(lua_State *L_main) {
-        L = luaL_newstate();
-        // FIXME check for failure?
-        lua_pushlightuserdata(L, this);
-        lua_rawseti(L, LUA_REGISTRYINDEX, 0);
-        luaL_openlibs(L);
-        //lua_pushcfunction(L, dummy_ConPrintf);
-        //lua_setglobal(L, "ConPrintf");
-        RegisterGeneralLuaCallbacks(L);
-        int err = luaL_loadstring(L, lua_tostring(L_main, 1));
-        if (err) {
-            std::cout << "Error in subscript: " << err << std::endl;
-            std::cout << lua_tostring(L, -1) << std::endl;
-        }
-        for (int stackpos = 4;stackpos <= lua_gettop(L_main);stackpos++) {
-            switch (lua_type(L_main, stackpos)) {
-            case LUA_TNIL:
-                lua_pushnil(L);
-                break;
-            case LUA_TBOOLEAN:
-                lua_pushboolean(L, lua_toboolean(L_main, stackpos));
-                break;
-            case LUA_TNUMBER:
-                lua_pushnumber(L, lua_tonumber(L_main, stackpos));
-                break;
-            case LUA_TSTRING:
-                lua_pushstring(L, lua_tostring(L_main, stackpos));
-                break;
-            }
-        }
-        lua_pushnumber(L, lua_gettop(L_main) - 3);
+    // Copies the script text and the extra arguments of the LaunchSubScript
+    // call on the main state's stack. Check argsError() before launching.
+    explicit SubScript(lua_State *L_main);
+
+    // Copies the script text and the argument sets, the elements of the
+    // array at `argSets`, each itself an array of arguments.
+    SubScript(lua_State *L_main, int argSets, bool ordered);
+
+    int itemCount() const {
+        return static_cast<int>(_args.size());
     }
-    
-    void run() override {
-        int numarg = (int)lua_tointeger(L, -1);
-        lua_pop(L, 1);
-        if (lua_pcall(L, numarg, LUA_MULTRET, 0)) {
-            std::cout << "Error in thread call: " << lua_tostring(L, -1) << std::endl;
-        }
-    };
-
-    void onSubFinished(lua_State *L_main, int id) {
-        lua_getfield(L_main, LUA_REGISTRYINDEX, "uicallbacks");
-        lua_getfield(L_main, -1, "MainObject");
-        lua_remove(L_main, -2);
-        lua_getfield(L_main, -1, "OnSubFinished");
-        lua_insert(L_main, -2);
-        lua_pushinteger(L_main, id);
-        int n = lua_gettop(L);
-        for (int i = 1; i <= n; i++) {
-            switch (lua_type(L, i)) {
-            case LUA_TNIL:
-                lua_pushnil(L_main);
-                break;
-            case LUA_TBOOLEAN:
-                lua_pushboolean(L_main, lua_toboolean(L, i));
-                break;
-            case LUA_TNUMBER:
-                lua_pushnumber(L_main, lua_tonumber(L, i));
-                break;
-            case LUA_TSTRING:
-                lua_pushstring(L_main, lua_tostring(L, i));
-                break;
-            default:
-                std::cout << "Subscript return " << (i - 1) << ": only nil, boolean, number and string can be returned from sub script" << std::endl;
-                return;
-            }
-        }
-        int result = lua_pcall(L_main, lua_gettop(L) + 2, 0, 0);
-        if (result) {
-            std::cout << "Error calling OnSubFinished: " << result << std::endl;
-            std::cout << lua_tostring(L_main, -1) << std::endl;
-        }
+
+    // Worker side: calls the compiled script on top of the stack of `L` with
+    // the item's arguments and keeps whatever it returns.
+    void run(lua_State *L, int item);
+
+    // Worker side, with the pool's mutex held. Returns true for the item
+    // that completes the subscript.
+    bool finishItem(int item, SubScriptWorker* worker);
+
+    // Main side: passes the results to OnSubFinished.
+    void onSubFinished(lua_State *L_main, int id);
+
+    const QByteArray& script() const {
+        return _script;
+    }
+
+    bool isFinished() const {
+        return _finished.load(std::memory_order_acquire);
     }
-    lua_State *L;
+
+    // An aborted subscript stops at its next hook check and its results, if
+    // any, are never delivered.
+    bool isAborted() const {
+        return _aborted.load(std::memory_order_relaxed);
+    }
+
+    void abort() {
+        _aborted.store(true, std::memory_order_relaxed);
+    }
+
+    // Empty if every argument could be copied, otherwise why the one at
+    // stack index badArg() couldn't. For a map, badArg() is the number of
+    // the argument set.
+    const std::string& argsError() const {
+        return _argsError;
+    }
+
+    int badArg() const {
+        return _badArg;
+    }
+
+    // Main side, once the workers are done with the arguments.
+    void releaseArgs();
+
+    // The results may refer to strings pinned in the state of the worker
+    // that ran the item, which has to release them once they have been
+    // delivered.
+    SubScriptWorker* worker(int item) const {
+        return _workers[item];
+    }
+
+    LuaValueBuffer takeResults(int item) {
+        return std::move(_results[item]);
+    }
+
+private:
+    void pushItemResults(lua_State *L_main, int item);
+
+    lua_State* _mainState;
+    QByteArray _script;
+    bool _isMap = false;
+    bool _ordered = true;
+    // One entry per item.
+    std::vector<LuaValueBuffer> _args;
+    std::vector<LuaValueBuffer> _results;
+    std::vector<SubScriptWorker*> _workers;
+    // Whether the item raised an error, char rather than bool so workers can
+    // write their own entries at once.
+    std::vector<char> _failed;
+    std::vector<char> _resultsOk;
+    // Item numbers in order of completion, and how many are still to come.
+    // Guarded by the pool's mutex.
+    std::vector<int> _completed;
+    int _remaining = 0;
+    std::string _argsError;
+    int _badArg = 0;
+    std::atomic<bool> _finished = false;
+    std::atomic<bool> _aborted = false;
 };
 
 #endif
@@ -0,0 +1,355 @@
+#include "subscript_pool.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <utility>
+
+#include "lua_profiler.hpp"
+#include "trace_recorder.hpp"
+
+namespace {
+    // Scripts are few and fixed in practice, this only guards against a
+    // caller generating script text on the fly.
+    constexpr int MaxCachedChunks = 64;
+    // VM instructions between abort checks once a hook is installed.
+    constexpr int AbortHookCount = 1000;
+    // How long stop() waits for running scripts to notice their abort.
+    constexpr auto StopTimeout = std::chrono::seconds(2);
+    // Matches the main state's sampling rate.
+    constexpr auto SampleInterval = std::chrono::milliseconds(1);
+
+    // Installed for an abort, which stays until the script errors out, or
+    // for a single profiler sample.
+    void WorkerHook(lua_State* L, lua_Debug*)
+    {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, 0);
+        auto* worker = static_cast<SubScriptWorker*>(lua_touserdata(L, -1));
+        lua_pop(L, 1);
+        if (worker == nullptr) {
+            return;
+        }
+        if (worker->currentAborted()) {
+            luaL_error(L, "subscript aborted");
+        }
+        if (uint32_t ticks = worker->takeSampleTicks(); ticks > 0) {
+            // Every tick missed while the hook couldn't fire is charged to
+            // where Lua is now, so time spent in compiled traces still
+            // counts, if against the stack the trace exited to.
+            luaProfiler.add(LuaProfiler::folded_stack(L), ticks);
+            lua_sethook(L, nullptr, 0, 0);
+            // An abort may have installed its hook in the meantime, which
+            // was just cleared.
+            if (worker->currentAborted()) {
+                luaL_error(L, "subscript aborted");
+            }
+        }
+    }
+}
+
+void SubScriptWorker::run()
+{
+    lua_State* L = _heap.new_state();
+    if (L == nullptr) {
+        std::cout << "Subscript worker: could not create Lua state" << std::endl;
+        return;
+    }
+    _L = L;
+    traceRecorder.set_thread_name("subscript worker");
+    lua_pushlightuserdata(L, this);
+    lua_rawseti(L, LUA_REGISTRYINDEX, 0);
+    luaL_openlibs(L);
+    RegisterGeneralLuaCallbacks(L);
+
+    // Each run gets a fresh environment falling back to the real globals, so
+    // globals set by one script don't leak into the next one.
+    lua_newtable(L);
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+    lua_setfield(L, -2, "__index");
+    lua_setfield(L, LUA_REGISTRYINDEX, "subscriptenvmeta");
+
+    for (auto job = _pool.take(*this); job.script; job = _pool.take(*this)) {
+        // A hook left over from an abort or a sample that raced with the end
+        // of the previous job.
+        lua_sethook(L, nullptr, 0, 0);
+        _sampleTicks = 0;
+        if (!job.script->isAborted()) {
+            TraceRecorder::Scope trace("subscript", "run");
+            if (pushChunk(L, job.script->script())) {
+                lua_newtable(L);
+                lua_getfield(L, LUA_REGISTRYINDEX, "subscriptenvmeta");
+                lua_setmetatable(L, -2);
+                lua_setfenv(L, -2);
+            }
+            job.script->run(L, job.item);
+            if (_abandoned.load()) {
+                // The pool gave up on this worker and may be gone. The
+                // state is left to the process exit rather than closed
+                // under a pool that no longer knows about it.
+                return;
+            }
+            lua_settop(L, 0);
+        }
+        _pool.finish(*this, job);
+    }
+    _heap.close_state(L);
+}
+
+bool SubScriptWorker::pushChunk(lua_State* L, const QByteArray& script)
+{
+    auto iter = _chunks.constFind(script);
+    if (iter != _chunks.cend()) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, *iter);
+        return true;
+    }
+    int err = luaL_loadbuffer(L, script.constData(), script.size(), script.constData());
+    if (err) {
+        std::cout << "Error in subscript: " << err << std::endl;
+        std::cout << lua_tostring(L, -1) << std::endl;
+        return false;
+    }
+    if (_chunks.size() >= MaxCachedChunks) {
+        for (int ref : std::as_const(_chunks)) {
+            luaL_unref(L, LUA_REGISTRYINDEX, ref);
+        }
+        _chunks.clear();
+    }
+    lua_pushvalue(L, -1);
+    _chunks.insert(script, luaL_ref(L, LUA_REGISTRYINDEX));
+    return true;
+}
+
+SubScriptPool::SubScriptPool(std::function<void()> onFinished)
+    : _onFinished(std::move(onFinished))
+{
+}
+
+SubScriptPool::~SubScriptPool()
+{
+    stop();
+}
+
+void SubScriptPool::start(int threads)
+{
+    if (threads <= 0) {
+        threads = std::max(1, QThread::idealThreadCount());
+    }
+    for (int i = 0; i < threads; i++) {
+        auto& worker = _workers.emplace_back(std::make_unique<SubScriptWorker>(*this, i + 1));
+        worker->start();
+    }
+}
+
+void SubScriptPool::stop()
+{
+    stopSampling();
+    {
+        auto lock = std::lock_guard(_mtx);
+        _loop = false;
+        _queue.clear();
+        for (auto& worker : _workers) {
+            if (worker->_current != nullptr) {
+                worker->_current->abort();
+                interrupt(worker->_current);
+            }
+        }
+    }
+    _cond.notify_all();
+    const auto deadline = std::chrono::steady_clock::now() + StopTimeout;
+    for (auto& worker : _workers) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (worker->wait(static_cast<unsigned long>(std::max<int64_t>(left.count(), 0)))) {
+            continue;
+        }
+        // Most likely stuck in a compiled trace, which never checks the
+        // abort hook. Destroying a running QThread is fatal, so the worker
+        // and its state are leaked to the process exit instead.
+        std::cout << "Subscript worker did not stop, abandoning it" << std::endl;
+        worker->_abandoned = true;
+        worker.release();
+    }
+    _workers.clear();
+}
+
+int SubScriptPool::launch(std::shared_ptr<SubScript> job)
+{
+    int id;
+    if (!_freeSlots.empty()) {
+        id = _freeSlots.back();
+        _freeSlots.pop_back();
+    } else {
+        id = static_cast<int>(_slots.size());
+        _slots.emplace_back();
+        _traceIds.emplace_back();
+    }
+    _slots[id] = job;
+    _traceIds[id] = ++_launches;
+    traceRecorder.async_begin("subscript", "subscript", _traceIds[id]);
+    int items = job->itemCount();
+    if (items == 0) {
+        // An empty map, finished as soon as it is launched.
+        {
+            auto lock = std::lock_guard(_mtx);
+            _finished.push_back(id);
+        }
+        _onFinished();
+        return id;
+    }
+    {
+        auto lock = std::lock_guard(_mtx);
+        for (int item = 0; item < items; item++) {
+            _queue.push_back({ id, item, job });
+        }
+    }
+    if (items > 1) {
+        _cond.notify_all();
+    } else {
+        _cond.notify_one();
+    }
+    return id;
+}
+
+void SubScriptPool::dispatchFinished(const std::function<void(int id, SubScript& job)>& dispatch)
+{
+    {
+        auto lock = std::lock_guard(_mtx);
+        std::swap(_dispatching, _finished);
+    }
+    bool unpin = false;
+    for (int id : _dispatching) {
+        auto job = std::move(_slots[id]);
+        traceRecorder.async_end("subscript", "subscript", _traceIds[id]);
+        if (!job->isAborted()) {
+            TraceRecorder::Scope trace("subscript", "OnSubFinished");
+            dispatch(id, *job);
+        }
+        job->releaseArgs();
+        for (int item = 0; item < job->itemCount(); item++) {
+            auto results = job->takeResults(item);
+            if (results.hasPins()) {
+                auto lock = std::lock_guard(_mtx);
+                job->worker(item)->_unpin.push_back(std::move(results));
+                unpin = true;
+            }
+        }
+        // Freed only now, OnSubFinished commonly launches the next subscript
+        // and must not be handed the id it is still being called for.
+        _freeSlots.push_back(id);
+    }
+    _dispatching.clear();
+    if (unpin) {
+        _cond.notify_all();
+    }
+}
+
+bool SubScriptPool::isRunning(int id) const
+{
+    return isValid(id) && !_slots[id]->isFinished() && !_slots[id]->isAborted();
+}
+
+void SubScriptPool::abort(int id)
+{
+    if (!isValid(id) || _slots[id]->isAborted()) {
+        return;
+    }
+    SubScript* job = _slots[id].get();
+    job->abort();
+    // Queued jobs are skipped by the worker that picks them up, finished
+    // ones by dispatchFinished(), so only a running one needs a nudge.
+    auto lock = std::lock_guard(_mtx);
+    interrupt(job);
+}
+
+void SubScriptPool::interrupt(SubScript* job)
+{
+    for (auto& worker : _workers) {
+        if (worker->_current == job) {
+            // lua_sethook is the one call that is safe on a state another
+            // thread is running. Only the interpreter checks hooks though,
+            // LuaJIT's compiled traces never do, so a script spinning in a
+            // hot compiled loop only stops once it leaves the trace, and
+            // one that never does can't be aborted at all.
+            lua_sethook(worker->_L, WorkerHook, LUA_MASKCOUNT, AbortHookCount);
+        }
+    }
+}
+
+SubScriptPool::Job SubScriptPool::take(SubScriptWorker& worker)
+{
+    auto lock = std::unique_lock(_mtx);
+    for (;;) {
+        _cond.wait(lock, [&] { return !_loop || !_queue.empty() || !worker._unpin.empty(); });
+        if (!_loop) {
+            return {};
+        }
+        if (worker._unpin.empty()) {
+            break;
+        }
+        auto unpin = std::move(worker._unpin);
+        worker._unpin.clear();
+        lock.unlock();
+        for (auto& results : unpin) {
+            results.releasePins(worker._L);
+        }
+        lock.lock();
+    }
+    auto job = std::move(_queue.front());
+    _queue.pop_front();
+    worker._current = job.script.get();
+    return job;
+}
+
+void SubScriptPool::finish(SubScriptWorker& worker, const Job& job)
+{
+    {
+        auto lock = std::lock_guard(_mtx);
+        worker._current = nullptr;
+        if (!job.script->finishItem(job.item, &worker)) {
+            return;
+        }
+        _finished.push_back(job.id);
+    }
+    _onFinished();
+}
+
+void SubScriptPool::startSampling()
+{
+    {
+        auto lock = std::lock_guard(_mtx);
+        if (_sampling) {
+            return;
+        }
+        _sampling = true;
+    }
+    _sampler = std::thread([this] { sampleLoop(); });
+}
+
+void SubScriptPool::stopSampling()
+{
+    {
+        auto lock = std::lock_guard(_mtx);
+        _sampling = false;
+    }
+    _samplerCond.notify_all();
+    if (_sampler.joinable()) {
+        _sampler.join();
+    }
+}
+
+void SubScriptPool::sampleLoop()
+{
+    auto lock = std::unique_lock(_mtx);
+    while (_sampling) {
+        for (auto& worker : _workers) {
+            if (worker->_current != nullptr) {
+                worker->_sampleTicks.fetch_add(1, std::memory_order_relaxed);
+                // The interpreter checks the hook on its next instruction,
+                // compiled traces never do, so a worker running a trace is
+                // only sampled once it leaves it. Like the abort hook this
+                // is only installed when needed.
+                lua_sethook(worker->_L, WorkerHook, LUA_MASKCOUNT, 1);
+            }
+        }
+        _samplerCond.wait_for(lock, SampleInterval);
+    }
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <QByteArray>
+#include <QHash>
+#include <QThread>
+
+#include "lua_heap.hpp"
+#include "subscript.hpp"
+
+class SubScriptPool;
+
+// Long-lived thread with a Lua state of its own, set up once with the
+// standard libraries and the general callbacks. Compiled scripts are kept
+// in the registry keyed by their text, so running the same script again
+// skips the parse.
+class SubScriptWorker : public QThread
+{
+public:
+    SubScriptWorker(SubScriptPool& pool, int number)
+        : _pool(pool)
+        , _heap(QString("subscript worker %1").arg(number)) {}
+
+    void run() override;
+
+    // Worker thread only, for the hook.
+    bool currentAborted() const {
+        return _current != nullptr && _current->isAborted();
+    }
+
+    // Sampler ticks since the last sample was taken.
+    uint32_t takeSampleTicks() {
+        return _sampleTicks.exchange(0, std::memory_order_relaxed);
+    }
+
+private:
+    friend class SubScriptPool;
+
+    // Pushes the compiled script, or the compile error message.
+    bool pushChunk(lua_State* L, const QByteArray& script);
+
+    SubScriptPool& _pool;
+    // Outlives the state, which it closes at the end of run().
+    LuaHeap _heap;
+    QHash<QByteArray, int> _chunks;
+    lua_State* _L = nullptr;
+    // Guarded by the pool's mutex, read freely by the worker itself.
+    SubScript* _current = nullptr;
+    // Delivered results whose pinned strings this worker's state can now
+    // let go of. Guarded by the pool's mutex.
+    std::vector<LuaValueBuffer> _unpin;
+    // Bumped by the sampler along with the hook each tick, for the
+    // profiler. The hook may only fire several ticks later.
+    std::atomic<uint32_t> _sampleTicks = 0;
+    // Set when stop() gave up waiting for this worker.
+    std::atomic<bool> _abandoned = false;
+};
+
+// Fixed set of workers, one per core unless told otherwise, so at most that
+// many subscript items run at once. Items beyond that wait in a FIFO queue,
+// the items of a map spread across whichever workers are free.
+//
+// Every launch gets an id, the index of a slot that is reused once the
+// subscript's results have been dispatched. Workers report completion by
+// id, so dispatching is constant time per subscript however many are in
+// flight. `onFinished` is called from the worker thread after each one, it
+// should get the GUI thread to call dispatchFinished().
+class SubScriptPool
+{
+public:
+    explicit SubScriptPool(std::function<void()> onFinished);
+    ~SubScriptPool();
+
+    // Needs the global pobwindow, RegisterGeneralLuaCallbacks reads from it.
+    void start(int threads = 0);
+    // Aborts whatever is running and waits up to a couple of seconds for
+    // it. Workers still running after that are abandoned, for shutdown.
+    void stop();
+
+    // GUI thread only, as is everything below.
+    int launch(std::shared_ptr<SubScript> job);
+    // Hands every finished subscript to `dispatch`, then frees its slot.
+    // Aborted ones are skipped.
+    void dispatchFinished(const std::function<void(int id, SubScript& job)>& dispatch);
+
+    bool isValid(int id) const {
+        return id >= 0 && id < static_cast<int>(_slots.size()) && _slots[id];
+    }
+    // Queued or running, and not aborted.
+    bool isRunning(int id) const;
+    // Drops the subscript if it is still queued, interrupts it if running.
+    // Either way its slot is freed by the next dispatchFinished().
+    void abort(int id);
+
+    // Samples the stacks of running subscripts into luaProfiler every
+    // SampleInterval, until stopSampling().
+    void startSampling();
+    void stopSampling();
+
+    size_t inFlight() const {
+        return _slots.size() - _freeSlots.size();
+    }
+
+private:
+    friend class SubScriptWorker;
+
+    struct Job
+    {
+        int id = -1;
+        int item = 0;
+        std::shared_ptr<SubScript> script;
+    };
+
+    // Blocks until there is work, an empty job once the pool is stopping.
+    // Releases pinned result strings handed back to `worker` meanwhile.
+    Job take(SubScriptWorker& worker);
+    void finish(SubScriptWorker& worker, const Job& job);
+    // Makes `job` stop at its next hook check if a worker is running it,
+    // which compiled code never reaches. Called with _mtx held.
+    void interrupt(SubScript* job);
+    void sampleLoop();
+
+    std::function<void()> _onFinished;
+    std::mutex _mtx;
+    std::condition_variable _cond;
+    std::deque<Job> _queue;
+    std::vector<int> _finished;
+    bool _loop = true;
+    std::vector<std::unique_ptr<SubScriptWorker>> _workers;
+
+    std::vector<std::shared_ptr<SubScript>> _slots;
+    // Launch number of each slot's subscript, which pairs up its trace span.
+    std::vector<uint64_t> _traceIds;
+    uint64_t _launches = 0;
+    std::vector<int> _freeSlots;
+    std::vector<int> _dispatching;
+
+    std::thread _sampler;
+    // Guarded by _mtx.
+    bool _sampling = false;
+    std::condition_variable _samplerCond;
+};
@@ -0,0 +1,169 @@
+#include "texture_atlas.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <QOpenGLTexture>
+
+namespace {
+    constexpr int Border = 1;
+}
+
+TextureAtlas::TextureAtlas() = default;
+
+TextureAtlas::~TextureAtlas() = default;
+
+bool TextureAtlas::eligible(const QImage& img, int levels, int flags)
+{
+    // Mip levels and nearest sampling can't be shared with the neighbours.
+    return levels == 1
+        && !(flags & TF_NEAREST)
+        && img.width() <= MaxImageSize
+        && img.height() <= MaxImageSize;
+}
+
+bool TextureAtlas::insert(TextureIndex idx, const QImage& img)
+{
+    const int w = img.width() + 2 * Border;
+    const int h = img.height() + 2 * Border;
+    int x = 0;
+    int y = 0;
+    size_t page = 0;
+    while (page < _pages.size() && !allocate(_pages[page], w, h, x, y)) {
+        page++;
+    }
+    if (page == _pages.size() && (!add_page() || !allocate(_pages[page], w, h, x, y))) {
+        return false;
+    }
+
+    // Replicate the outermost texels into the border.
+    QImage padded(w, h, QImage::Format_RGBA8888);
+    for (int row = 0; row < h; ++row) {
+        const uchar* src = img.constScanLine(std::clamp(row - Border, 0, img.height() - 1));
+        uchar* dst = padded.scanLine(row);
+        std::memcpy(dst + Border * 4, src, img.width() * 4);
+        std::memcpy(dst, src, 4);
+        std::memcpy(dst + (w - 1) * 4, src + (img.width() - 1) * 4, 4);
+    }
+
+    auto& p = _pages[page];
+    p.texture->bind();
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, padded.constBits());
+    p.texture->release();
+    p.live++;
+
+    const float scale = 1.0f / PageSize;
+    _entries[idx.GetIndex()] = {
+        .page = page,
+        .rect = { x, y, w, h },
+        .region = {
+            .u0 = (x + Border) * scale,
+            .v0 = (y + Border) * scale,
+            .u1 = (x + Border + img.width()) * scale,
+            .v1 = (y + Border + img.height()) * scale,
+            },
+        };
+    return true;
+}
+
+QOpenGLTexture* TextureAtlas::find(TextureIndex idx, TextureRegion& region) const
+{
+    auto iter = _entries.find(idx.GetIndex());
+    if (iter == _entries.end()) {
+        return nullptr;
+    }
+    region = iter->second.region;
+    return _pages[iter->second.page].texture.get();
+}
+
+bool TextureAtlas::remove(TextureIndex idx)
+{
+    auto iter = _entries.find(idx.GetIndex());
+    if (iter == _entries.end()) {
+        return false;
+    }
+    auto& page = _pages[iter->second.page];
+    if (--page.live == 0) {
+        page.shelf_y = 0;
+        page.shelf_h = 0;
+        page.cursor_x = 0;
+        page.free.clear();
+    } else {
+        page.free.push_back(iter->second.rect);
+    }
+    _entries.erase(iter);
+    return true;
+}
+
+void TextureAtlas::clear()
+{
+    _entries.clear();
+    _pages.clear();
+}
+
+bool TextureAtlas::allocate(Page& page, int w, int h, int& x, int& y)
+{
+    if (allocate_free(page, w, h, x, y)) {
+        return true;
+    }
+    if (page.cursor_x + w > PageSize) {
+        page.shelf_y += page.shelf_h;
+        page.shelf_h = 0;
+        page.cursor_x = 0;
+    }
+    if (page.shelf_y + h > PageSize) {
+        return false;
+    }
+    x = page.cursor_x;
+    y = page.shelf_y;
+    page.cursor_x += w;
+    page.shelf_h = std::max(page.shelf_h, h);
+    return true;
+}
+
+bool TextureAtlas::add_page()
+{
+    if (static_cast<int>(_pages.size()) >= MaxPages) {
+        return false;
+    }
+    auto tex = std::make_unique<QOpenGLTexture>(QOpenGLTexture::Target2D);
+    tex->setFormat(QOpenGLTexture::RGBA8_UNorm);
+    tex->setSize(PageSize, PageSize);
+    tex->setMipLevels(1);
+    tex->allocateStorage(QOpenGLTexture::RGBA, QOpenGLTexture::UInt8);
+    if (!tex->isStorageAllocated()) {
+        return false;
+    }
+    tex->setMinMagFilters(QOpenGLTexture::Linear, QOpenGLTexture::Linear);
+    tex->setWrapMode(QOpenGLTexture::ClampToEdge);
+    _pages.push_back({ .texture = std::move(tex) });
+    return true;
+}
+
+bool TextureAtlas::allocate_free(Page& page, int w, int h, int& x, int& y)
+{
+    // Smallest free rectangle the image fits in.
+    auto best = page.free.end();
+    for (auto iter = page.free.begin(); iter != page.free.end(); ++iter) {
+        if (iter->w >= w && iter->h >= h
+                && (best == page.free.end() || iter->w * iter->h < best->w * best->h)) {
+            best = iter;
+        }
+    }
+    if (best == page.free.end()) {
+        return false;
+    }
+    const Rect rect = *best;
+    page.free.erase(best);
+    x = rect.x;
+    y = rect.y;
+    // What's left over to the right of the image and below it.
+    if (rect.w > w) {
+        page.free.push_back({ rect.x + w, rect.y, rect.w - w, h });
+    }
+    if (rect.h > h) {
+        page.free.push_back({ rect.x, rect.y + h, rect.w, rect.h - h });
+    }
+    return true;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <QImage>
+
+#include "lazy_loaded_texture.hpp"
+
+class QOpenGLTexture;
+
+// Packs small single level images into shared pages so that runs of icons
+// are drawn from one texture. Each image gets a one texel border copied from
+// its edges, so linear filtering never picks up a neighbour. Space is
+// handed out in shelves; a removed image's rectangle goes on its page's
+// free list, where later images are fitted before opening a new shelf,
+// and a page is reset whole once every image on it has been removed.
+//
+// insert() and clear() must be called with the GL context current.
+class TextureAtlas
+{
+public:
+    static constexpr int PageSize = 1024;
+    static constexpr int MaxImageSize = 128;
+    static constexpr int MaxPages = 16;
+
+    TextureAtlas();
+    ~TextureAtlas();
+
+    static bool eligible(const QImage& img, int levels, int flags);
+
+    // Returns false if no page has room, the image should then get a texture
+    // of its own.
+    bool insert(TextureIndex idx, const QImage& img);
+    QOpenGLTexture* find(TextureIndex idx, TextureRegion& region) const;
+    // Returns true if the image was in the atlas.
+    bool remove(TextureIndex idx);
+    void clear();
+
+    size_t page_count() const {
+        return _pages.size();
+    }
+
+    size_t vram_bytes() const {
+        return page_count() * PageSize * PageSize * 4;
+    }
+
+private:
+    struct Rect
+    {
+        int x;
+        int y;
+        int w;
+        int h;
+    };
+
+    struct Page
+    {
+        std::unique_ptr<QOpenGLTexture> texture;
+        int shelf_y = 0;
+        int shelf_h = 0;
+        int cursor_x = 0;
+        int live = 0;
+        // Space given back by removed images, borders included.
+        std::vector<Rect> free;
+    };
+
+    struct Entry
+    {
+        size_t page;
+        Rect rect;
+        TextureRegion region;
+    };
+
+    static bool allocate(Page& page, int w, int h, int& x, int& y);
+    static bool allocate_free(Page& page, int w, int h, int& x, int& y);
+    bool add_page();
+
+private:
+    std::vector<Page> _pages;
+    std::unordered_map<size_t, Entry> _entries;
+};
@@ -7,26 +7,53 @@
 #include <utility>
 #include <vector>
 
-#include <QImage>
-#include <QOpenGLTexture>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+
+#include "disk_cache.hpp"
+#include "trace_recorder.hpp"
 
 namespace {
     constexpr size_t LoadedLowWaterMark = 1024 * 1024 * 1024;
     constexpr size_t LoadedHighWaterMark = 2 * LoadedLowWaterMark;
+    // Below this the compression artifacts cost more than the VRAM saved.
+    constexpr int CompressMinPixels = 512 * 512;
+    // Bump whenever the encoder or the packed layout changes.
+    constexpr int DiskCacheVersion = 1;
+    constexpr qint64 DiskCacheMaxBytes = 512 * 1024 * 1024;
+    constexpr int DiskCacheMaxAgeDays = 30;
+}
+
+void TextureLoader::set_disk_cache(const QString& dir)
+{
+    if (QDir().mkpath(dir)) {
+        _disk_cache_dir = dir;
+    }
 }
 
-void TextureLoader::request_load(const LazyLoadedTexture& tex)
+void TextureLoader::request_load(const LazyLoadedTexture& tex, std::shared_ptr<const QByteArray> packed, QSize size)
 {
     auto lock = std::lock_guard(_to_load_mtx);
-    _to_load.push_back(&tex);
+    _to_load.push_back({ tex.index, std::move(packed), size });
     _to_load_cond.notify_one();
 }
 
-void TextureLoader::collect_loaded_textures(std::vector<std::pair<TextureIndex, std::unique_ptr<QImage>>>& loaded)
+void TextureLoader::collect_loaded_textures(std::vector<std::pair<TextureIndex, std::unique_ptr<DecodedTexture>>>& loaded)
 {
     auto lock = std::lock_guard(_loaded_mtx);
     std::swap(loaded, _loaded);
     _loaded_cond.notify_one();
+    size_t bytes = 0;
+    for (const auto& [index, img] : loaded) {
+        if (img) {
+            bytes += img->byte_size();
+        }
+    }
+    _pending_bytes.fetch_sub(bytes, std::memory_order_relaxed);
 }
 
 void TextureLoader::stop()
@@ -38,6 +65,11 @@ void TextureLoader::stop()
 
 void TextureLoader::run()
 {
+    traceRecorder.set_thread_name("texture loader");
+    if (!_disk_cache_dir.isEmpty()) {
+        TraceRecorder::Scope trace("loader", "prune disk cache");
+        PruneDiskCache(_disk_cache_dir, ".tex", DiskCacheMaxBytes, DiskCacheMaxAgeDays);
+    }
     while (_loop) {
         bool sleep = false;
         if (_to_load_th.empty()) {
@@ -46,7 +78,7 @@ void TextureLoader::run()
 
         auto iter = begin(_to_load_th);
         for (auto e = end(_to_load_th); iter != e; ++iter) {
-            auto* llt = *iter;
+            auto* llt = _table.find(iter->index);
             if (!_loop) {
                 return;
             }
@@ -55,11 +87,26 @@ void TextureLoader::run()
             }
 
             auto& loaded_tex = _loaded_th.emplace_back(
-                    std::make_pair(llt->index, nullptr)
+                    std::make_pair(iter->index, nullptr)
                     );
-            auto img = std::make_unique<QImage>(llt->path);
-            if (!img->isNull()) {
-                _loaded_mem_size = img->size().width() * img->size().height() * 4;
+            if (llt == nullptr) {
+                continue;
+            }
+            TraceRecorder::Scope trace("loader", "load", llt->path);
+            std::unique_ptr<DecodedTexture> img;
+            if (iter->packed) {
+                img = UnpackTexture(*iter->packed);
+                if (img) {
+                    img->packed = std::move(iter->packed);
+                }
+            }
+            if (!img) {
+                img = load(*llt, iter->size.isValid() ? iter->size : llt->size);
+            }
+            if (img) {
+                img->content_hash = ContentHash(*img);
+                _loaded_mem_size += img->byte_size();
+                _pending_bytes.fetch_add(img->byte_size(), std::memory_order_relaxed);
                 loaded_tex.second = std::move(img);
             }
         }
@@ -81,6 +128,68 @@ void TextureLoader::run()
     }
 }
 
+std::unique_ptr<DecodedTexture> TextureLoader::load_now(const LazyLoadedTexture& tex, QSize size)
+{
+    TraceRecorder::Scope trace("loader", "load now", tex.path);
+    auto img = load(tex, size);
+    if (img) {
+        img->content_hash = ContentHash(*img);
+    }
+    return img;
+}
+
+std::unique_ptr<DecodedTexture> TextureLoader::load(const LazyLoadedTexture& tex, QSize size)
+{
+    const bool compress = _block_compression
+        && size.width() * size.height() >= CompressMinPixels;
+    const QString cache_path = compress ? disk_cache_path(tex, size) : QString();
+    if (!cache_path.isEmpty()) {
+        QFile file(cache_path);
+        if (file.open(QIODevice::ReadOnly)) {
+            auto packed = std::make_shared<const QByteArray>(file.readAll());
+            auto img = UnpackTexture(*packed);
+            if (img && img->compressed()) {
+                TouchDiskCacheEntry(file);
+                img->packed = std::move(packed);
+                return img;
+            }
+            file.close();
+            file.remove();
+        }
+    }
+
+    TraceRecorder::Scope trace("loader", "decode", tex.path);
+    auto img = DecodeTexture(tex.path, size, !(tex.flags & TF_NOMIPMAP), compress);
+    if (!img) {
+        return nullptr;
+    }
+    img->packed = PackTexture(*img);
+    if (!cache_path.isEmpty() && img->packed && img->compressed()) {
+        QSaveFile file(cache_path);
+        if (file.open(QIODevice::WriteOnly)) {
+            file.write(*img->packed);
+            file.commit();
+        }
+    }
+    return img;
+}
+
+QString TextureLoader::disk_cache_path(const LazyLoadedTexture& tex, QSize size) const
+{
+    QFileInfo info(tex.path);
+    if (_disk_cache_dir.isEmpty() || !info.exists()) {
+        return {};
+    }
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(tex.path.toUtf8());
+    hash.addData(QByteArray::number(info.lastModified().toMSecsSinceEpoch()));
+    hash.addData(QByteArray::number(info.size()));
+    hash.addData(QByteArray::number(size.width()) + "x" + QByteArray::number(size.height()));
+    hash.addData(QByteArray::number(tex.flags & TF_NOMIPMAP));
+    hash.addData(QByteArray::number(DiskCacheVersion));
+    return _disk_cache_dir + "/" + QString::fromLatin1(hash.result().toHex()) + ".tex";
+}
+
 void TextureLoader::collect_to_load(bool block)
 {
     auto lock = std::unique_lock(_to_load_mtx);
@@ -1,22 +1,50 @@
 #pragma once
 
+#include <atomic>
 #include <condition_variable>
 #include <functional>
 #include <memory>
 
+#include <QString>
 #include <QThread>
 #include <mutex>
 #include <vector>
 
+#include "decoded_texture.hpp"
 #include "lazy_loaded_texture.hpp"
+#include "texture_table.hpp"
 
-class QOpenGLTexture;
+struct LoadRequest
+{
+    TextureIndex index;
+    // CPU side copy from the residency manager, skips decoding the file.
+    std::shared_ptr<const QByteArray> packed;
+    // Resolution to decode at, the full image if invalid.
+    QSize size;
+};
 
 class TextureLoader: public QThread
 {
 public:
-    void request_load(const LazyLoadedTexture& tex);
-    void collect_loaded_textures(std::vector<std::pair<TextureIndex, std::unique_ptr<QImage>>>& loaded);
+    explicit TextureLoader(const TextureTable& table) : _table(table) {}
+
+    void request_load(const LazyLoadedTexture& tex, std::shared_ptr<const QByteArray> packed = nullptr, QSize size = {});
+    // Large images are block compressed once the GL context reports S3TC
+    // support, everything else stays RGBA8.
+    void set_block_compression(bool enabled) {
+        _block_compression = enabled;
+    }
+    // Compressed images are cached in `dir` across runs, the least recently
+    // used pruned when the loader starts. Call before start().
+    void set_disk_cache(const QString& dir);
+    // Decodes on the calling thread instead, for images wanted on the next
+    // frame. Safe to call while the loader runs.
+    std::unique_ptr<DecodedTexture> load_now(const LazyLoadedTexture& tex, QSize size);
+    void collect_loaded_textures(std::vector<std::pair<TextureIndex, std::unique_ptr<DecodedTexture>>>& loaded);
+    // Decoded pixels not collected yet.
+    size_t pending_bytes() const {
+        return _pending_bytes.load(std::memory_order_relaxed);
+    }
     void stop();
 
     void run() override;
@@ -24,19 +52,25 @@ public:
 private:
     void collect_to_load(bool block);
     void push_loaded(bool block);
+    std::unique_ptr<DecodedTexture> load(const LazyLoadedTexture& tex, QSize size);
+    QString disk_cache_path(const LazyLoadedTexture& tex, QSize size) const;
 
 private:
+    const TextureTable& _table;
     bool _loop = true;
+    std::atomic<bool> _block_compression = false;
+    QString _disk_cache_dir;
 
     std::mutex _to_load_mtx;
     std::condition_variable _to_load_cond;
-    std::vector<const LazyLoadedTexture*> _to_load;
+    std::vector<LoadRequest> _to_load;
 
     std::mutex _loaded_mtx;
     std::condition_variable _loaded_cond;
-    std::vector<std::pair<TextureIndex, std::unique_ptr<QImage>>> _loaded;
+    std::vector<std::pair<TextureIndex, std::unique_ptr<DecodedTexture>>> _loaded;
 
-    std::vector<const LazyLoadedTexture*> _to_load_th;
-    std::vector<std::pair<TextureIndex, std::unique_ptr<QImage>>> _loaded_th;
+    std::vector<LoadRequest> _to_load_th;
+    std::vector<std::pair<TextureIndex, std::unique_ptr<DecodedTexture>>> _loaded_th;
     size_t _loaded_mem_size = 0;
+    std::atomic<size_t> _pending_bytes = 0;
 };
@@ -0,0 +1,143 @@
+#include "texture_residency.hpp"
+
+#include <algorithm>
+#include <utility>
+
+#include <QOpenGLTexture>
+
+TextureResidency::TextureResidency(size_t vram_budget, size_t cpu_budget)
+    : _vram_budget(vram_budget)
+    , _cpu_budget(cpu_budget)
+{
+}
+
+TextureResidency::~TextureResidency() = default;
+
+QOpenGLTexture* TextureResidency::get(TextureIndex idx, uint64_t frame)
+{
+    auto iter = _resident.find(idx.GetIndex());
+    if (iter == _resident.end()) {
+        return nullptr;
+    }
+    iter->second.last_used = frame;
+    return iter->second.texture.get();
+}
+
+void TextureResidency::insert(TextureIndex idx, std::unique_ptr<QOpenGLTexture> tex, size_t bytes, uint64_t frame)
+{
+    auto& res = _resident[idx.GetIndex()];
+    if (res.texture) {
+        _released.push_back(std::move(res.texture));
+        _vram_bytes -= res.bytes;
+    }
+    res.texture = std::move(tex);
+    res.bytes = bytes;
+    res.last_used = frame;
+    _vram_bytes += bytes;
+}
+
+void TextureResidency::store_copy(TextureIndex idx, std::shared_ptr<const QByteArray> packed, uint64_t frame)
+{
+    if (!packed) {
+        return;
+    }
+    auto& copy = _copies[idx.GetIndex()];
+    if (copy.data) {
+        _cpu_bytes -= copy.data->size();
+    }
+    copy.data = std::move(packed);
+    copy.last_used = frame;
+    _cpu_bytes += copy.data->size();
+}
+
+std::shared_ptr<const QByteArray> TextureResidency::find_copy(TextureIndex idx) const
+{
+    auto iter = _copies.find(idx.GetIndex());
+    if (iter == _copies.end()) {
+        return nullptr;
+    }
+    return iter->second.data;
+}
+
+void TextureResidency::release(TextureIndex idx)
+{
+    auto res = _resident.find(idx.GetIndex());
+    if (res != _resident.end()) {
+        _vram_bytes -= res->second.bytes;
+        _released.push_back(std::move(res->second.texture));
+        _resident.erase(res);
+    }
+    auto copy = _copies.find(idx.GetIndex());
+    if (copy != _copies.end()) {
+        _cpu_bytes -= copy->second.data->size();
+        _copies.erase(copy);
+    }
+}
+
+void TextureResidency::evict(uint64_t frame)
+{
+    _released.clear();
+    if (_vram_bytes > _vram_budget) {
+        evict_vram(frame);
+    }
+    if (_cpu_bytes > _cpu_budget) {
+        evict_cpu();
+    }
+}
+
+void TextureResidency::clear()
+{
+    _released.clear();
+    _resident.clear();
+    _copies.clear();
+    _vram_bytes = 0;
+    _cpu_bytes = 0;
+}
+
+void TextureResidency::set_budget(size_t vram_budget, size_t cpu_budget)
+{
+    _vram_budget = vram_budget;
+    _cpu_budget = cpu_budget;
+}
+
+void TextureResidency::evict_vram(uint64_t frame)
+{
+    std::vector<std::pair<uint64_t, size_t>> candidates;
+    for (const auto& [idx, res] : _resident) {
+        if (res.last_used < frame) {
+            candidates.emplace_back(res.last_used, idx);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+    for (const auto& [last_used, idx] : candidates) {
+        if (_vram_bytes <= _vram_budget) {
+            break;
+        }
+        auto res = _resident.find(idx);
+        _vram_bytes -= res->second.bytes;
+        _resident.erase(res);
+        // The copy is now the only fast way back, keep it around longest.
+        auto copy = _copies.find(idx);
+        if (copy != _copies.end()) {
+            copy->second.last_used = frame;
+        }
+    }
+}
+
+void TextureResidency::evict_cpu()
+{
+    std::vector<std::pair<uint64_t, size_t>> candidates;
+    candidates.reserve(_copies.size());
+    for (const auto& [idx, copy] : _copies) {
+        candidates.emplace_back(copy.last_used, idx);
+    }
+    std::sort(candidates.begin(), candidates.end());
+    for (const auto& [last_used, idx] : candidates) {
+        if (_cpu_bytes <= _cpu_budget) {
+            break;
+        }
+        auto copy = _copies.find(idx);
+        _cpu_bytes -= copy->second.data->size();
+        _copies.erase(copy);
+    }
+}
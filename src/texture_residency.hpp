@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <QByteArray>
+
+#include "lazy_loaded_texture.hpp"
+
+class QOpenGLTexture;
+
+// Owns every GPU texture created from an image handle. Textures are evicted
+// least-recently-drawn first once the VRAM budget is exceeded, but a
+// compressed CPU side copy is kept (within its own budget) so that drawing
+// an evicted texture again only costs an inflate and an upload.
+//
+// Destroying GL textures needs a current context, so release() only queues
+// them; evict() and clear() must be called with the context current.
+class TextureResidency
+{
+public:
+    TextureResidency(size_t vram_budget, size_t cpu_budget);
+    ~TextureResidency();
+
+    // Returns nullptr on a miss. Marks the texture as used in `frame`.
+    QOpenGLTexture* get(TextureIndex idx, uint64_t frame);
+    void insert(TextureIndex idx, std::unique_ptr<QOpenGLTexture> tex, size_t bytes, uint64_t frame);
+
+    void store_copy(TextureIndex idx, std::shared_ptr<const QByteArray> packed, uint64_t frame);
+    std::shared_ptr<const QByteArray> find_copy(TextureIndex idx) const;
+
+    // Drops the GPU texture and the CPU copy, used when no handle refers to
+    // the image anymore.
+    void release(TextureIndex idx);
+
+    // Brings both caches back under budget. Textures used in `frame` are never
+    // evicted, so the budget is allowed to overshoot for a single huge frame.
+    void evict(uint64_t frame);
+    void clear();
+
+    void set_budget(size_t vram_budget, size_t cpu_budget);
+
+    size_t vram_bytes() const {
+        return _vram_bytes;
+    }
+
+    size_t cpu_bytes() const {
+        return _cpu_bytes;
+    }
+
+private:
+    struct Resident
+    {
+        std::unique_ptr<QOpenGLTexture> texture;
+        size_t bytes = 0;
+        uint64_t last_used = 0;
+    };
+
+    struct CpuCopy
+    {
+        std::shared_ptr<const QByteArray> data;
+        uint64_t last_used = 0;
+    };
+
+    void evict_vram(uint64_t frame);
+    void evict_cpu();
+
+private:
+    std::unordered_map<size_t, Resident> _resident;
+    std::unordered_map<size_t, CpuCopy> _copies;
+    std::vector<std::unique_ptr<QOpenGLTexture>> _released;
+    size_t _vram_budget;
+    size_t _cpu_budget;
+    size_t _vram_bytes = 0;
+    size_t _cpu_bytes = 0;
+};
@@ -0,0 +1,94 @@
+#include "texture_table.hpp"
+
+#include <stdexcept>
+#include <utility>
+
+TextureTable::TextureTable()
+{
+    // Slot 0 is the null texture, drawn as plain white.
+    add("<none>", { 1, 1 });
+    find(0)->state = LoadState::Loaded;
+}
+
+TextureTable::~TextureTable()
+{
+    for (auto& chunk : _chunks) {
+        delete[] chunk.load(std::memory_order_relaxed);
+    }
+}
+
+TextureIndex TextureTable::add(const QString& path, QSize size, int flags)
+{
+    size_t idx;
+    if (!_free.empty()) {
+        idx = _free.back();
+        _free.pop_back();
+    } else {
+        idx = _next;
+        if ((idx >> ChunkBits) >= MaxChunks) {
+            throw std::runtime_error("texture table is full");
+        }
+        auto& chunk = _chunks[idx >> ChunkBits];
+        if (chunk.load(std::memory_order_relaxed) == nullptr) {
+            chunk.store(new Slot[ChunkSize], std::memory_order_release);
+        }
+        _next++;
+    }
+
+    Slot* s = slot(idx);
+    s->used = true;
+    s->tex = {
+        .index = TextureIndex(idx, s->generation),
+        .path = path,
+        .size = size,
+        .state = LoadState::NotLoaded,
+        .flags = flags,
+        };
+    _live++;
+    return s->tex.index;
+}
+
+void TextureTable::remove(TextureIndex idx)
+{
+    if (!idx.IsValid() || find(idx) == nullptr) {
+        return;
+    }
+    Slot* s = slot(idx.GetIndex());
+    s->used = false;
+    s->generation++;
+    s->tex = {};
+    _free.push_back(idx.GetIndex());
+    _live--;
+}
+
+LazyLoadedTexture* TextureTable::find(TextureIndex idx)
+{
+    return const_cast<LazyLoadedTexture*>(std::as_const(*this).find(idx));
+}
+
+const LazyLoadedTexture* TextureTable::find(TextureIndex idx) const
+{
+    Slot* s = slot(idx.GetIndex());
+    if (s == nullptr || !s->used || s->generation != idx.GetGeneration()) {
+        return nullptr;
+    }
+    return &s->tex;
+}
+
+LazyLoadedTexture& TextureTable::operator[](TextureIndex idx)
+{
+    auto* tex = find(idx);
+    return tex != nullptr ? *tex : slot(0)->tex;
+}
+
+TextureTable::Slot* TextureTable::slot(size_t idx) const
+{
+    if ((idx >> ChunkBits) >= MaxChunks) {
+        return nullptr;
+    }
+    Slot* chunk = _chunks[idx >> ChunkBits].load(std::memory_order_acquire);
+    if (chunk == nullptr) {
+        return nullptr;
+    }
+    return &chunk[idx & (ChunkSize - 1)];
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "lazy_loaded_texture.hpp"
+
+// Slab of LazyLoadedTexture slots. Slots live in fixed size chunks that are
+// never moved or freed while the table exists, so a slot can be read from
+// the loader thread without copying it. Removed slots are reused with a
+// bumped generation; a stale TextureIndex then no longer resolves.
+//
+// Only the GUI thread adds and removes textures. The loader only looks up
+// textures it was asked to load, and those are never removed while their
+// state is LoadState::Loading.
+class TextureTable
+{
+public:
+    TextureTable();
+    ~TextureTable();
+
+    TextureTable(const TextureTable&) = delete;
+    TextureTable& operator=(const TextureTable&) = delete;
+
+    TextureIndex add(const QString& path, QSize size, int flags = TF_NOMIPMAP);
+    void remove(TextureIndex idx);
+
+    // Returns nullptr for stale or unknown indices.
+    LazyLoadedTexture* find(TextureIndex idx);
+    const LazyLoadedTexture* find(TextureIndex idx) const;
+
+    // Like find(), but falls back to the null texture in slot 0.
+    LazyLoadedTexture& operator[](TextureIndex idx);
+
+    // Number of live textures, including the null texture.
+    size_t size() const {
+        return _live;
+    }
+
+private:
+    static constexpr size_t ChunkBits = 8;
+    static constexpr size_t ChunkSize = size_t(1) << ChunkBits;
+    static constexpr size_t MaxChunks = 1024;
+
+    struct Slot
+    {
+        LazyLoadedTexture tex;
+        uint32_t generation = 0;
+        bool used = false;
+    };
+
+    Slot* slot(size_t idx) const;
+
+private:
+    std::atomic<Slot*> _chunks[MaxChunks] = {};
+    size_t _next = 0;
+    std::vector<size_t> _free;
+    size_t _live = 0;
+};
@@ -0,0 +1,365 @@
+#include "texture_uploader.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <QOffscreenSurface>
+#include <QOpenGLBuffer>
+#include <QOpenGLContext>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLFunctions>
+#include <QOpenGLTexture>
+
+#include "trace_recorder.hpp"
+
+namespace {
+    constexpr size_t PboCount = 4;
+    // Largest band copied through a single PBO.
+    constexpr size_t MaxSliceBytes = 4 * 1024 * 1024;
+    constexpr int64_t DefaultBudgetNsecs = 3 * 1000 * 1000;
+    constexpr size_t DefaultBudgetBytes = 16 * 1024 * 1024;
+
+    GLenum CompressedFormat(TextureEncoding encoding)
+    {
+        return encoding == TextureEncoding::BC1
+            ? static_cast<GLenum>(QOpenGLTexture::RGB_DXT1)
+            : static_cast<GLenum>(QOpenGLTexture::RGBA_DXT5);
+    }
+}
+
+TextureUploader::TextureUploader()
+    : _budget_nsecs(DefaultBudgetNsecs)
+    , _budget_bytes(DefaultBudgetBytes)
+{
+}
+
+TextureUploader::~TextureUploader()
+{
+    stop();
+}
+
+void TextureUploader::initialize(QOpenGLContext* share)
+{
+    const bool has_sync = share->format().version() >= qMakePair(3, 2)
+        || share->hasExtension("GL_ARB_sync");
+    if (has_sync && QOpenGLContext::supportsThreadedOpenGL()) {
+        auto surface = std::make_unique<QOffscreenSurface>();
+        surface->setFormat(share->format());
+        surface->create();
+        auto context = std::make_unique<QOpenGLContext>();
+        context->setFormat(share->format());
+        context->setShareContext(share);
+        if (surface->isValid() && context->create() && context->shareContext() == share) {
+            _surface = std::move(surface);
+            _context = std::move(context);
+            _gui_thread = QThread::currentThread();
+            _context->moveToThread(this);
+            start();
+            return;
+        }
+    }
+    create_pbos();
+}
+
+void TextureUploader::create_pbos()
+{
+    for (size_t i = 0; i < PboCount; ++i) {
+        auto pbo = std::make_unique<QOpenGLBuffer>(QOpenGLBuffer::PixelUnpackBuffer);
+        pbo->setUsagePattern(QOpenGLBuffer::StreamDraw);
+        if (!pbo->create()) {
+            // No PBO support, upload_rows() falls back to client memory.
+            _pbos.clear();
+            return;
+        }
+        _pbos.push_back(std::move(pbo));
+    }
+}
+
+void TextureUploader::cleanup()
+{
+    stop();
+    if (_context) {
+        auto* gl = QOpenGLContext::currentContext()->extraFunctions();
+        for (auto& f : _finished) {
+            if (f.fence != nullptr) {
+                gl->glDeleteSync(f.fence);
+            }
+        }
+    }
+    _finished.clear();
+    _in_flight = 0;
+    _urgent.clear();
+    _pending.clear();
+    _pbos.clear();
+}
+
+void TextureUploader::stop()
+{
+    if (!isRunning()) {
+        return;
+    }
+    {
+        auto lock = std::lock_guard(_mtx);
+        _loop = false;
+    }
+    _cond.notify_one();
+    wait();
+}
+
+void TextureUploader::enqueue(TextureIndex idx, std::unique_ptr<DecodedTexture> img, int flags)
+{
+    if (!(flags & TF_ASYNC)) {
+        // Only ever touched by the GUI thread.
+        _urgent.push_back({ .index = idx, .image = std::move(img), .flags = flags });
+        return;
+    }
+    auto lock = std::unique_lock(_mtx, std::defer_lock);
+    if (_context) {
+        lock.lock();
+        _in_flight++;
+    }
+    _pending.push_back({ .index = idx, .image = std::move(img), .flags = flags });
+    _cond.notify_one();
+}
+
+void TextureUploader::process(std::vector<UploadedTexture>& uploaded)
+{
+    size_t bytes = 0;
+    while (!_urgent.empty()) {
+        if (!upload_band(_urgent.front(), MaxSliceBytes, bytes, uploaded)) {
+            _urgent.pop_front();
+        }
+    }
+
+    if (_context) {
+        collect_finished(uploaded);
+        return;
+    }
+
+    while (!_pending.empty()) {
+        const size_t bytes_left = _budget_bytes > _frame_bytes ? _budget_bytes - _frame_bytes : 0;
+        if (!upload_band(_pending.front(), std::min(bytes_left, MaxSliceBytes), _frame_bytes, uploaded)) {
+            _pending.pop_front();
+        }
+        if (!budget_left()) {
+            break;
+        }
+    }
+}
+
+void TextureUploader::begin_frame()
+{
+    _frame_timer.start();
+    _frame_bytes = 0;
+}
+
+bool TextureUploader::budget_left() const
+{
+    return _frame_bytes < _budget_bytes && _frame_timer.nsecsElapsed() < _budget_nsecs;
+}
+
+void TextureUploader::run()
+{
+    traceRecorder.set_thread_name("texture uploader");
+    _context->makeCurrent(_surface.get());
+    create_pbos();
+    auto* gl = _context->extraFunctions();
+    std::vector<UploadedTexture> done;
+    for (;;) {
+        PendingUpload up;
+        {
+            auto lock = std::unique_lock(_mtx);
+            _cond.wait(lock, [this] { return !_loop || !_pending.empty(); });
+            if (!_loop) {
+                break;
+            }
+            up = std::move(_pending.front());
+            _pending.pop_front();
+        }
+
+        TraceRecorder::Scope trace("uploader", "upload");
+        size_t bytes = 0;
+        while (upload_band(up, MaxSliceBytes, bytes, done)) {
+        }
+        GLsync fence = nullptr;
+        if (done.back().texture) {
+            fence = gl->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        }
+        // The fence is only visible to the window's context once flushed.
+        gl->glFlush();
+
+        auto lock = std::lock_guard(_mtx);
+        _finished.push_back({ std::move(done.back()), fence });
+        done.clear();
+    }
+    _pbos.clear();
+    _context->doneCurrent();
+    _context->moveToThread(_gui_thread);
+}
+
+void TextureUploader::collect_finished(std::vector<UploadedTexture>& uploaded)
+{
+    auto* gl = QOpenGLContext::currentContext()->extraFunctions();
+    auto lock = std::lock_guard(_mtx);
+    // Fences from one context signal in order, nothing after the first
+    // unsignalled one can be ready either.
+    while (!_finished.empty()) {
+        auto& f = _finished.front();
+        if (f.fence != nullptr) {
+            const GLenum status = gl->glClientWaitSync(f.fence, 0, 0);
+            if (status == GL_TIMEOUT_EXPIRED) {
+                break;
+            }
+            gl->glDeleteSync(f.fence);
+            if (status == GL_WAIT_FAILED) {
+                // Nothing says the texture is complete, hand it out as a
+                // failed upload rather than draw from it.
+                f.upload.texture.reset();
+            }
+        }
+        uploaded.push_back(std::move(f.upload));
+        _finished.pop_front();
+        _in_flight--;
+    }
+}
+
+bool TextureUploader::upload_band(PendingUpload& up, size_t max_bytes, size_t& bytes, std::vector<UploadedTexture>& uploaded)
+{
+    if (!up.texture && !create_texture(up)) {
+        uploaded.push_back({ .index = up.index });
+        return false;
+    }
+
+    // Always make some progress, even if a single row exceeds the budget.
+    const int row_count = up.image->row_count(up.level);
+    int rows = static_cast<int>(max_bytes / up.image->row_bytes(up.level));
+    rows = std::clamp(rows, 1, row_count - up.next_row);
+    bytes += upload_rows(up, rows);
+
+    if (up.next_row == row_count) {
+        up.next_row = 0;
+        up.level++;
+    }
+    if (up.level < static_cast<int>(up.image->levels.size())) {
+        return true;
+    }
+    uploaded.push_back({
+        .index = up.index,
+        .texture = std::move(up.texture),
+        .bytes = up.image->byte_size(),
+        .size = QSize(up.image->width(), up.image->height()),
+        .packed = std::move(up.image->packed),
+        });
+    return false;
+}
+
+void TextureUploader::set_frame_budget(int64_t nsecs, size_t bytes)
+{
+    _budget_nsecs = nsecs;
+    _budget_bytes = bytes;
+}
+
+bool TextureUploader::create_texture(PendingUpload& up)
+{
+    auto tex = std::make_unique<QOpenGLTexture>(QOpenGLTexture::Target2D);
+    const int levels = static_cast<int>(up.image->levels.size());
+    if (up.image->compressed()) {
+        // Qt's mutable storage path passes no image size for compressed
+        // formats, which strict drivers reject, so allocate each level here.
+        if (!tex->create()) {
+            return false;
+        }
+        auto* gl = QOpenGLContext::currentContext()->functions();
+        tex->bind();
+        for (int i = 0; i < levels; ++i) {
+            const auto& level = up.image->levels[i];
+            gl->glCompressedTexImage2D(GL_TEXTURE_2D, i, CompressedFormat(up.image->encoding),
+                                       level.width, level.height, 0,
+                                       static_cast<GLsizei>(level.data.size()), nullptr);
+        }
+        tex->release();
+        tex->setMipMaxLevel(levels - 1);
+    } else {
+        tex->setFormat(QOpenGLTexture::RGBA8_UNorm);
+        tex->setSize(up.image->width(), up.image->height());
+        tex->setMipLevels(levels);
+        tex->allocateStorage(QOpenGLTexture::RGBA, QOpenGLTexture::UInt8);
+        if (!tex->isStorageAllocated()) {
+            return false;
+        }
+    }
+
+    // Sampler state is fixed for the lifetime of the texture.
+    if (levels > 1) {
+        tex->setMinificationFilter(QOpenGLTexture::LinearMipMapLinear);
+    } else {
+        tex->setMinificationFilter(QOpenGLTexture::Linear);
+    }
+    tex->setMagnificationFilter((up.flags & TF_NEAREST) ? QOpenGLTexture::Nearest : QOpenGLTexture::Linear);
+    tex->setWrapMode((up.flags & TF_CLAMP) ? QOpenGLTexture::ClampToEdge : QOpenGLTexture::Repeat);
+    up.texture = std::move(tex);
+    return true;
+}
+
+size_t TextureUploader::upload_rows(PendingUpload& up, int rows)
+{
+    const auto& level = up.image->levels[up.level];
+    const size_t row_bytes = up.image->row_bytes(up.level);
+    const char* src = level.data.constData() + up.next_row * row_bytes;
+    // The last row may be short, both for pixel bands and block rows.
+    const size_t size = std::min(static_cast<size_t>(rows) * row_bytes,
+                                 static_cast<size_t>(level.data.size()) - up.next_row * row_bytes);
+    const int y = up.next_row * up.image->row_height();
+    const int height = std::min(rows * up.image->row_height(), level.height - y);
+
+    // Stage the band in a PBO so glTexSubImage2D returns immediately and the
+    // driver copies it to the texture asynchronously.
+    const void* pixels = src;
+    QOpenGLBuffer* pbo = next_pbo();
+    if (pbo != nullptr && pbo->bind()) {
+        // Re-allocating orphans the previous storage instead of waiting on it.
+        pbo->allocate(static_cast<int>(size));
+        void* dst = pbo->map(QOpenGLBuffer::WriteOnly);
+        if (dst != nullptr) {
+            std::memcpy(dst, src, size);
+            pbo->unmap();
+            pixels = nullptr;
+        } else {
+            pbo->release();
+            pbo = nullptr;
+        }
+    } else {
+        pbo = nullptr;
+    }
+
+    up.texture->bind();
+    if (up.image->compressed()) {
+        auto* gl = QOpenGLContext::currentContext()->functions();
+        gl->glCompressedTexSubImage2D(GL_TEXTURE_2D, up.level, 0, y, level.width, height,
+                                      CompressedFormat(up.image->encoding),
+                                      static_cast<GLsizei>(size), pixels);
+    } else {
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexSubImage2D(GL_TEXTURE_2D, up.level, 0, y, level.width, height,
+                        GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    }
+    up.texture->release();
+    if (pbo != nullptr) {
+        pbo->release();
+    }
+
+    up.next_row += rows;
+    return size;
+}
+
+QOpenGLBuffer* TextureUploader::next_pbo()
+{
+    // The ring belongs to the upload thread when there is one, urgent
+    // uploads on the GUI thread then go from client memory.
+    if (_pbos.empty() || (_context && QThread::currentThread() != this)) {
+        return nullptr;
+    }
+    auto* pbo = _pbos[_next_pbo].get();
+    _next_pbo = (_next_pbo + 1) % _pbos.size();
+    return pbo;
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <QElapsedTimer>
+#include <QThread>
+#include <qopengl.h>
+
+#include "decoded_texture.hpp"
+#include "lazy_loaded_texture.hpp"
+
+class QOffscreenSurface;
+class QOpenGLBuffer;
+class QOpenGLContext;
+class QOpenGLTexture;
+
+struct UploadedTexture
+{
+    TextureIndex index;
+    // Null if storage could not be allocated.
+    std::unique_ptr<QOpenGLTexture> texture;
+    size_t bytes = 0;
+    QSize size;
+    std::shared_ptr<const QByteArray> packed;
+};
+
+// Streams decoded images into GL textures a band of rows at a time through a
+// small ring of pixel buffer objects. Images arrive already converted,
+// mipmapped and possibly block compressed by the loader, so uploading is a
+// plain copy.
+//
+// Where the platform allows it, uploads run on a thread of their own with a
+// context shared with the window's. Each finished texture is published with
+// a fence, and process() only hands it out once the fence has signalled, so
+// the frame loop never waits on an upload. Otherwise uploads run inside
+// process() on the GUI thread: each call stops once the per-frame time or
+// byte budget is spent and leftover work carries over to the next frame.
+// Either way textures loaded without TF_ASYNC are uploaded in full by the
+// next process() on the GUI thread, regardless of the budget, so they are
+// ready for the frame being drawn.
+//
+// The public methods are for the GUI thread, with the window's context
+// current.
+class TextureUploader: public QThread
+{
+public:
+    TextureUploader();
+    ~TextureUploader();
+
+    void initialize(QOpenGLContext* share);
+    void cleanup();
+
+    void enqueue(TextureIndex idx, std::unique_ptr<DecodedTexture> img, int flags);
+    // Starts this frame's budget, which process() shares with whatever else
+    // the GUI thread copies to the GPU.
+    void begin_frame();
+    // Charges `bytes` copied outside process() to this frame's budget.
+    void charge(size_t bytes) {
+        _frame_bytes += bytes;
+    }
+    bool budget_left() const;
+    // Appends every texture that finished uploading.
+    void process(std::vector<UploadedTexture>& uploaded);
+
+    bool has_pending() const {
+        return pending_count() > 0;
+    }
+
+    size_t pending_count() const {
+        return (_context ? _in_flight : _pending.size()) + _urgent.size();
+    }
+
+    bool is_threaded() const {
+        return _context != nullptr;
+    }
+
+    void set_frame_budget(int64_t nsecs, size_t bytes);
+
+    void run() override;
+
+private:
+    struct PendingUpload
+    {
+        TextureIndex index;
+        std::unique_ptr<DecodedTexture> image;
+        std::unique_ptr<QOpenGLTexture> texture;
+        int flags = 0;
+        int level = 0;
+        int next_row = 0;
+    };
+
+    struct FinishedUpload
+    {
+        UploadedTexture upload;
+        // Null if the upload failed or fences aren't needed.
+        GLsync fence = nullptr;
+    };
+
+    void create_pbos();
+    void stop();
+    void collect_finished(std::vector<UploadedTexture>& uploaded);
+    // Returns false once `up` is finished or failed and was moved to `uploaded`.
+    bool upload_band(PendingUpload& up, size_t max_bytes, size_t& bytes, std::vector<UploadedTexture>& uploaded);
+    bool create_texture(PendingUpload& up);
+    size_t upload_rows(PendingUpload& up, int rows);
+    QOpenGLBuffer* next_pbo();
+
+private:
+    std::deque<PendingUpload> _urgent;
+    std::deque<PendingUpload> _pending;
+    std::vector<std::unique_ptr<QOpenGLBuffer>> _pbos;
+    size_t _next_pbo = 0;
+    int64_t _budget_nsecs;
+    size_t _budget_bytes;
+    QElapsedTimer _frame_timer;
+    size_t _frame_bytes = 0;
+
+    // Threaded mode only. _pending is then guarded by _mtx.
+    std::unique_ptr<QOffscreenSurface> _surface;
+    std::unique_ptr<QOpenGLContext> _context;
+    QThread* _gui_thread = nullptr;
+    std::mutex _mtx;
+    std::condition_variable _cond;
+    std::deque<FinishedUpload> _finished;
+    bool _loop = true;
+    size_t _in_flight = 0;
+};
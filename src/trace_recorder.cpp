@@ -0,0 +1,169 @@
+#include "trace_recorder.hpp"
+
+#include <chrono>
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+
+TraceRecorder traceRecorder;
+
+namespace {
+    const auto TraceEpoch = std::chrono::steady_clock::now();
+}
+
+TraceRecorder::Scope::Scope(const char* category, const char* name, const QString& detail)
+    : _category(category)
+    , _name(name)
+{
+    if (traceRecorder.enabled()) {
+        _detail = detail;
+        _start = traceRecorder.now();
+    }
+}
+
+TraceRecorder::Scope::~Scope()
+{
+    if (_start >= 0 && traceRecorder.enabled()) {
+        traceRecorder.complete(_category, _name, _detail, _start, traceRecorder.now());
+    }
+}
+
+int64_t TraceRecorder::now() const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - TraceEpoch).count();
+}
+
+int TraceRecorder::thread_id()
+{
+    static std::atomic<int> next_id = 1;
+    thread_local int id = next_id.fetch_add(1, std::memory_order_relaxed);
+    return id;
+}
+
+void TraceRecorder::set_thread_name(const QString& name)
+{
+    auto lock = std::lock_guard(_mtx);
+    _thread_names[thread_id()] = name;
+}
+
+void TraceRecorder::start()
+{
+    {
+        auto lock = std::lock_guard(_mtx);
+        _events.clear();
+    }
+    _started.store(true);
+    _enabled.store(true, std::memory_order_relaxed);
+}
+
+void TraceRecorder::add(Event&& event)
+{
+    auto lock = std::lock_guard(_mtx);
+    if (!enabled()) {
+        return;
+    }
+    _events.push_back(std::move(event));
+    if (_events.size() >= MaxEvents) {
+        _enabled.store(false, std::memory_order_relaxed);
+    }
+}
+
+void TraceRecorder::complete(const char* category, const QString& name, const QString& detail, int64_t start, int64_t end)
+{
+    add({ .phase = 'X', .category = category, .name = name, .detail = detail, .tid = thread_id(), .ts = start, .dur = end - start });
+}
+
+void TraceRecorder::begin_zone(const QString& name)
+{
+    if (enabled()) {
+        add({ .phase = 'B', .category = "lua", .name = name, .tid = thread_id(), .ts = now() });
+    }
+}
+
+void TraceRecorder::end_zone()
+{
+    if (enabled()) {
+        add({ .phase = 'E', .category = "lua", .tid = thread_id(), .ts = now() });
+    }
+}
+
+void TraceRecorder::async_begin(const char* category, const QString& name, uint64_t id)
+{
+    if (enabled()) {
+        add({ .phase = 'b', .category = category, .name = name, .tid = thread_id(), .ts = now(), .id = id });
+    }
+}
+
+void TraceRecorder::async_end(const char* category, const QString& name, uint64_t id)
+{
+    if (enabled()) {
+        add({ .phase = 'e', .category = category, .name = name, .tid = thread_id(), .ts = now(), .id = id });
+    }
+}
+
+void TraceRecorder::counter(const char* category, const QString& name, double value)
+{
+    if (enabled()) {
+        add({ .phase = 'C', .category = category, .name = name, .tid = thread_id(), .ts = now(), .value = value });
+    }
+}
+
+bool TraceRecorder::stop(const QString& path)
+{
+    _enabled.store(false, std::memory_order_relaxed);
+    if (!_started.exchange(false)) {
+        return false;
+    }
+    std::vector<Event> events;
+    QJsonArray trace;
+    {
+        auto lock = std::lock_guard(_mtx);
+        events.swap(_events);
+        for (const auto& [tid, name] : _thread_names) {
+            trace.append(QJsonObject{
+                { "ph", "M" },
+                { "name", "thread_name" },
+                { "pid", 1 },
+                { "tid", tid },
+                { "args", QJsonObject{ { "name", name } } },
+            });
+        }
+    }
+
+    for (const auto& e : events) {
+        QJsonObject event{
+            { "ph", QString::fromLatin1(&e.phase, 1) },
+            { "cat", e.category },
+            { "pid", 1 },
+            { "tid", e.tid },
+            { "ts", static_cast<qint64>(e.ts) },
+        };
+        if (!e.name.isEmpty()) {
+            event.insert("name", e.name);
+        }
+        if (e.phase == 'X') {
+            event.insert("dur", static_cast<qint64>(e.dur));
+        }
+        if (e.phase == 'b' || e.phase == 'e') {
+            event.insert("id", static_cast<qint64>(e.id));
+        }
+        if (e.phase == 'C') {
+            event.insert("args", QJsonObject{ { "value", e.value } });
+        } else if (!e.detail.isEmpty()) {
+            event.insert("args", QJsonObject{ { "detail", e.detail } });
+        }
+        trace.append(event);
+    }
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    file.write(QJsonDocument(QJsonObject{
+        { "traceEvents", trace },
+        { "displayTimeUnit", "ms" },
+    }).toJson(QJsonDocument::Compact));
+    return file.commit();
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <QString>
+
+// Opt-in timeline of what every thread was doing, written out as Chrome
+// trace JSON for chrome://tracing or Perfetto. Switched on and off from Lua
+// with SetProfiling.
+//
+// While off, recording costs one relaxed atomic load per scope. While on,
+// events go into one mutex-guarded list; what is traced is at most a few
+// events per frame, texture or subscript, so contention stays negligible.
+// Recording stops by itself once MaxEvents is reached.
+class TraceRecorder
+{
+public:
+    static constexpr size_t MaxEvents = 1 << 20;
+
+    // Records a complete event from construction to destruction, if tracing
+    // was on when it started.
+    class Scope
+    {
+    public:
+        Scope(const char* category, const char* name, const QString& detail = {});
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        const char* _category;
+        const char* _name;
+        QString _detail;
+        int64_t _start = -1;
+    };
+
+    bool enabled() const {
+        return _enabled.load(std::memory_order_relaxed);
+    }
+
+    // Discards whatever was recorded before.
+    void start();
+    // Stops recording and writes the trace. Returns false if it wasn't
+    // started or couldn't be written.
+    bool stop(const QString& path);
+
+    // Names the calling thread in the trace. Call once when a thread starts,
+    // tracing on or not.
+    void set_thread_name(const QString& name);
+
+    void complete(const char* category, const QString& name, const QString& detail, int64_t start, int64_t end);
+    // Nested zones on the calling thread, for Lua.
+    void begin_zone(const QString& name);
+    void end_zone();
+    // Spans that start and end on different threads or call stacks. `id`
+    // pairs them up within the category.
+    void async_begin(const char* category, const QString& name, uint64_t id);
+    void async_end(const char* category, const QString& name, uint64_t id);
+    // A sample of a value plotted over time, like a GPU timing.
+    void counter(const char* category, const QString& name, double value);
+
+    // Microseconds on the trace's clock.
+    int64_t now() const;
+
+private:
+    struct Event
+    {
+        char phase;
+        const char* category;
+        QString name;
+        QString detail;
+        int tid;
+        int64_t ts;
+        int64_t dur = 0;
+        uint64_t id = 0;
+        double value = 0.0;
+    };
+
+    void add(Event&& event);
+    static int thread_id();
+
+    std::atomic<bool> _enabled = false;
+    // Stays set when MaxEvents turns recording off, until stop().
+    std::atomic<bool> _started = false;
+    std::mutex _mtx;
+    std::vector<Event> _events;
+    std::unordered_map<int, QString> _thread_names;
+};
+
+extern TraceRecorder traceRecorder;